@@ -1,13 +1,16 @@
 #pragma once
 
 #include <eosio/asset.hpp>
+#include <eosio/binary_extension.hpp>
 #include <eosio/privileged.hpp>
 #include <eosio/singleton.hpp>
 #include <eosio/system.hpp>
 #include <eosio/time.hpp>
 
 #include <eosio.system/native.hpp>
+#include <eosio.system/row_cache.hpp>
 
+#include <algorithm>
 #include <deque>
 #include <optional>
 #include <string>
@@ -78,6 +81,9 @@ namespace eosiosystem {
    static constexpr int64_t  ram_gift_bytes        = 1400;
    static constexpr int64_t  min_pervote_daily_pay = 100'0000;
    static constexpr uint32_t refund_delay_sec      = 3 * seconds_per_day;
+   static constexpr uint32_t onblock_recalc_rows   = 50;  // producer weights recalculated per schedule update
+   static constexpr uint32_t onblock_fold_rows     = 1000; // pending vote deltas folded per schedule update
+   static constexpr uint32_t onblock_proxy_rows    = 20;  // proxies whose weight is propagated per schedule update
 
    static constexpr int64_t  inflation_precision           = 100;     // 2 decimals
    static constexpr int64_t  default_annual_rate           = 500;     // 5% annual rate
@@ -105,6 +111,27 @@ namespace eosiosystem {
    };
    typedef eosio::multi_index< "acntype"_n, ebos_account_type >  account_type_table;
 
+   // Accounts of a `newaccounts` batch whose creation fee `creator` already paid and that are not created yet.
+   struct [[eosio::table("acntcredit"), eosio::contract("eosio.system")]] account_creation_credit {
+      account_creation_credit() { }
+      name       creator;
+      uint32_t   accounts = 0;
+      symbol     core_symbol;   /// core symbol read by the batch, used by `newaccount` in place of the `state` row it would read
+
+      uint64_t primary_key()const { return creator.value; }
+      EOSLIB_SERIALIZE( account_creation_credit, (creator)(accounts)(core_symbol) )
+   };
+   typedef eosio::multi_index< "acntcredit"_n, account_creation_credit >  account_credit_table;
+
+   // An account to create with `newaccounts`.
+   struct new_account_spec {
+      name        account;
+      authority   owner;
+      authority   active;
+
+      EOSLIB_SERIALIZE( new_account_spec, (account)(owner)(active) )
+   };
+
    struct [[eosio::table("cwl"), eosio::contract("eosio.system")]] ebos_contract_white_list {
       ebos_contract_white_list() { }
       name   account;
@@ -114,6 +141,12 @@ namespace eosiosystem {
    };
    typedef eosio::multi_index< "cwl"_n, ebos_contract_white_list >  cwl_table;
 
+   // Operation of `awlsetmany` on the contract white list, passed as its `uint8_t` value.
+   enum class cwl_operation : uint8_t {
+      add    = 0,
+      remove = 1
+   };
+
 
    /**
     * eosio.system contract defines the structures and actions needed for blockchain's core functionality.
@@ -176,6 +209,9 @@ namespace eosiosystem {
 
 
    // Defines `producer_info` structure to be stored in `producer_info` table, added after version 1.0
+   // The vote counters (`total_vote_weight`, `company_votes`, `government_votes`) are kept only for
+   // rows registered before `prodtally` existed. They are moved to `prodtally` by `migrateprods`, which
+   // leaves them zero here; votes are read from `prodtally` and its `prototalvote` index.
    struct [[eosio::table, eosio::contract("eosio.system")]] producer_info {
       name                  owner;
       double                total_vote_weight = 0;
@@ -188,7 +224,6 @@ namespace eosiosystem {
       time_point            last_claim_time;
       uint16_t              location = 0;
       uint64_t primary_key()const { return owner.value;                             }
-      double   by_votes()const    { return is_active ? -total_vote_weight : total_vote_weight;  }
       bool     active()const      { return is_active;                               }
       void     deactivate()       { producer_key = public_key(); is_active = false; }
 
@@ -197,6 +232,39 @@ namespace eosiosystem {
                         (unpaid_blocks)(last_claim_time)(location) )
    };
 
+   // Defines `producer_tally` structure to be stored in `prodtally` table. It holds the fields every vote
+   // rewrites, so a vote does not reserialize the key and url of `producer_info`.
+   // `total_vote_weight` is exact: the vote counters times their weights, summed in 128 bits.
+   struct [[eosio::table, eosio::contract("eosio.system")]] producer_tally {
+      static constexpr uint128_t max_vote_weight = ( uint128_t(1) << 127 ) - 1;
+
+      name                  owner;
+      uint128_t             total_vote_weight = 0;
+      int64_t               company_votes = 0;
+      int64_t               government_votes = 0;
+      bool                  is_active = true;
+
+      uint64_t  primary_key()const { return owner.value;                                }
+      bool      active()const      { return is_active;                                  }
+      uint128_t by_votes()const    { return ranking_key( is_active, total_vote_weight ); }
+
+      // Key of the `prototalvote` index: the top bit is set for inactive producers so that they sort after
+      // every active one, the low 127 bits order active producers by descending and inactive ones by ascending
+      // weight. The index orders rows with equal keys by primary key, which breaks ties by owner.
+      static uint128_t ranking_key( bool active, uint128_t weight ) {
+         weight = std::min( weight, max_vote_weight );
+         return active ? max_vote_weight - weight : max_vote_weight + 1 + weight;
+      }
+
+      void update_weight( const vote_weight_state& vw ) {
+         total_vote_weight = uint128_t( std::max<int64_t>( company_votes, 0 ) ) * vw.company_weight
+                           + uint128_t( std::max<int64_t>( government_votes, 0 ) ) * vw.government_weight;
+      }
+
+      // explicit serialization macro is not necessary, used here only to improve compilation time
+      EOSLIB_SERIALIZE( producer_tally, (owner)(total_vote_weight)(company_votes)(government_votes)(is_active) )
+   };
+
 
    // Voter info. Voter info stores information about the voter:
    // - `owner` the voter
@@ -210,12 +278,12 @@ namespace eosiosystem {
       int64_t             staked = 0;
 
       //  Every time a vote is cast we must first "undo" the last vote weight, before casting the
-      //  new vote weight.  Vote weight is calculated as:
-      //  stated.amount * 2 ^ ( weeks_since_launch/weeks_per_year)
-      double              last_vote_weight = 0; /// the vote weight cast the last time the vote was updated
+      //  new vote weight.  Vote weights are integer stake amounts; both fields used to be doubles
+      //  that were never set, so existing rows read them as 0.
+      int64_t             last_vote_weight = 0; /// the vote weight cast the last time the vote was updated
 
       // Total vote weight delegated to this voter.
-      double              proxied_vote_weight= 0; /// the total vote weight delegated to this voter as a proxy
+      int64_t             proxied_vote_weight= 0; /// the total vote weight delegated to this voter as a proxy
       bool                is_proxy = 0; /// whether the voter is a proxy for others
 
 
@@ -225,12 +293,30 @@ namespace eosiosystem {
 
       uint64_t primary_key()const { return owner.value; }
 
+      // Weight carried by the producers of this voter, and the weight they should carry. A proxy's producers
+      // are updated with its proxied weight only when `dirtyproxy` is folded, direct voters apply their stake at once.
+      int64_t applied_vote_weight()const { return is_proxy ? last_vote_weight : staked; }
+      int64_t vote_weight()const         { return is_proxy ? staked + proxied_vote_weight : staked; }
+
       enum class flags1_fields : uint32_t {
          ram_managed = 1,
          net_managed = 2,
-         cpu_managed = 4
+         cpu_managed = 4,
+         company_account = 8,      ///< cached `acntype` of the voter
+         government_account = 16
       };
 
+      name account_type()const {
+         if( has_field( flags1, flags1_fields::company_account ) )    return name_company;
+         if( has_field( flags1, flags1_fields::government_account ) ) return name_government;
+         return name();
+      }
+
+      void set_account_type( const name& type ) {
+         flags1 = set_field( flags1, flags1_fields::company_account, type == name_company );
+         flags1 = set_field( flags1, flags1_fields::government_account, type == name_government );
+      }
+
       // explicit serialization macro is not necessary, used here only to improve compilation time
       EOSLIB_SERIALIZE( voter_info, (owner)(proxy)(producers)(staked)(last_vote_weight)(proxied_vote_weight)(is_proxy)(flags1)(reserved2)(reserved3) )
    };
@@ -238,10 +324,67 @@ namespace eosiosystem {
 
    typedef eosio::multi_index< "voters"_n, voter_info >  voters_table;
 
+   // Position of a batch job that is resumed over several actions, keyed by the job name.
+   // A row exists only while the job is in progress.
+   struct [[eosio::table("cursors"), eosio::contract("eosio.system")]] batch_cursor {
+      name       job;
+      uint64_t   next = 0; /// primary key of the next row to process
+
+      uint64_t primary_key()const { return job.value; }
+      EOSLIB_SERIALIZE( batch_cursor, (job)(next) )
+   };
+   typedef eosio::multi_index< "cursors"_n, batch_cursor >  batch_cursor_table;
 
-   typedef eosio::multi_index< "producers"_n, producer_info,
-                               indexed_by<"prototalvote"_n, const_mem_fun<producer_info, double, &producer_info::by_votes>  >
-                             > producers_table;
+
+   struct vote_delta {
+      name                  producer;
+      int64_t               company_votes = 0;
+      int64_t               government_votes = 0;
+
+      EOSLIB_SERIALIZE( vote_delta, (producer)(company_votes)(government_votes) )
+   };
+
+   // Vote changes of `voter` queued while `lazy_votes` is set, one entry per producer sorted by producer,
+   // applied to the tallies by onblock. Keyed by voter, so queuing a vote writes no row shared with other voters.
+   struct [[eosio::table, eosio::contract("eosio.system")]] pending_vote_delta {
+      name                     voter;
+      std::vector<vote_delta>  deltas;
+
+      uint64_t primary_key()const { return voter.value; }
+
+      // explicit serialization macro is not necessary, used here only to improve compilation time
+      EOSLIB_SERIALIZE( pending_vote_delta, (voter)(deltas) )
+   };
+   typedef eosio::multi_index< "votedelta"_n, pending_vote_delta >  pending_vote_delta_table;
+
+   // Proxy whose `proxied_vote_weight` changed since its producers were last updated.
+   struct [[eosio::table, eosio::contract("eosio.system")]] dirty_proxy {
+      name                  proxy;
+
+      uint64_t primary_key()const { return proxy.value; }
+
+      // explicit serialization macro is not necessary, used here only to improve compilation time
+      EOSLIB_SERIALIZE( dirty_proxy, (proxy) )
+   };
+   typedef eosio::multi_index< "dirtyproxy"_n, dirty_proxy >  dirty_proxy_table;
+
+   // Producer whose weight changed in a way that may alter the elected set since the last ranking scan.
+   // Kept per producer, so that votes and stake changes do not write the shared `elected` row.
+   struct [[eosio::table, eosio::contract("eosio.system")]] ranking_change {
+      name                  producer;
+
+      uint64_t primary_key()const { return producer.value; }
+
+      // explicit serialization macro is not necessary, used here only to improve compilation time
+      EOSLIB_SERIALIZE( ranking_change, (producer) )
+   };
+   typedef eosio::multi_index< "rankchange"_n, ranking_change >  ranking_change_table;
+
+   typedef eosio::multi_index< "producers"_n, producer_info > producers_table;
+
+   typedef eosio::multi_index< "prodtally"_n, producer_tally,
+                               indexed_by<"prototalvote"_n, const_mem_fun<producer_tally, uint128_t, &producer_tally::by_votes>  >
+                             > producer_tally_table;
 
    typedef eosio::singleton< "global"_n, eosio_global_state >   global_state_singleton;
 
@@ -249,20 +392,97 @@ namespace eosiosystem {
 
    typedef eosio::singleton< "global3"_n, eosio_global_state3 > global_state3_singleton;
 
+   // Defines the `state` singleton, the single row that holds what used to be stored in the `global`,
+   // `global2`, `global3` and `voteweight` singletons.
+   struct [[eosio::table("state"), eosio::contract("eosio.system")]] system_state {
+      system_state() { }
+      uint8_t               version = 1; ///< layout version of this row, bumped whenever it changes
+      eosio_global_state    global;
+      eosio_global_state2   global2;
+      eosio_global_state3   global3;
+      vote_weight_state     vote_weight;
+      eosio::binary_extension<bool>  lazy_votes; ///< votes are queued in `votedelta` and folded by onblock, unset reads as false
+
+      bool lazy()const { return lazy_votes.has_value() && lazy_votes.value(); }
+
+      EOSLIB_SERIALIZE( system_state, (version)(global)(global2)(global3)(vote_weight)(lazy_votes) )
+   };
+   typedef eosio::singleton< "state"_n, system_state > system_state_singleton;
+
+   // Defines the `elected` singleton: the producer set found by the last ranking scan of `update_elected_producers`.
+   // The scan is skipped unless `stale` is set or a change that may alter the set was recorded in `rankchange`.
+   struct [[eosio::table("elected"), eosio::contract("eosio.system")]] elected_producers_state {
+      elected_producers_state() { }
+      std::vector<name>  producers;                   /// members of the set, sorted by name
+      uint128_t          min_vote_weight = 0;         /// lowest member weight, 0 while the set has less than 21 members
+      uint128_t          runner_up_vote_weight = 0;   /// highest weight of an active producer outside the set
+      checksum256        schedule_hash;               /// hash of the last successfully proposed schedule
+      bool               stale = true;                /// the set must be recomputed regardless of `rankchange`
+
+      bool is_member( const name& producer )const {
+         return std::binary_search( producers.begin(), producers.end(), producer );
+      }
+
+      EOSLIB_SERIALIZE( elected_producers_state, (producers)(min_vote_weight)(runner_up_vote_weight)(schedule_hash)(stale) )
+   };
+   typedef eosio::singleton< "elected"_n, elected_producers_state > elected_producers_singleton;
+
+   /**
+    * Action-scoped view of a singleton row: the row is read on first access only, and `flush`
+    * writes it back only if it was obtained for writing through `modify`.
+    */
+   template<typename Singleton, typename T>
+   class lazy_singleton {
+      public:
+         lazy_singleton( name code, uint64_t scope, T (*make_default)() = nullptr )
+         :_tbl(code, scope), _make_default(make_default) {}
+
+         const T& get() {
+            if( !_state ) {
+               _state = _tbl.exists() ? _tbl.get() : ( _make_default ? _make_default() : T{} );
+            }
+            return *_state;
+         }
+
+         T& modify() {
+            get();
+            _dirty = true;
+            return *_state;
+         }
+
+         void flush( name payer ) {
+            if( _dirty ) {
+               _tbl.set( *_state, payer );
+               _dirty = false;
+            }
+         }
+
+      private:
+         Singleton         _tbl;
+         T               (*_make_default)();
+         std::optional<T>  _state;
+         bool              _dirty = false;
+   };
+
    struct [[eosio::table, eosio::contract("eosio.system")]] user_resources {
       name          owner;
       asset         net_weight;
       asset         cpu_weight;
       int64_t       ram_bytes = 0;
 
+      // The part of `cpu_weight` staked by `owner` to itself, which has no `delband` row.
+      // Rows without it may still have a `delband` row to self, see `foldselfbw`.
+      eosio::binary_extension<asset> self_cpu_weight;
+
       bool is_empty()const { return net_weight.amount == 0 && cpu_weight.amount == 0 && ram_bytes == 0; }
+      asset self_stake()const { return self_cpu_weight.has_value() ? self_cpu_weight.value() : asset( 0, cpu_weight.symbol ); }
       uint64_t primary_key()const { return owner.value; }
 
       // explicit serialization macro is not necessary, used here only to improve compilation time
-      EOSLIB_SERIALIZE( user_resources, (owner)(net_weight)(cpu_weight)(ram_bytes) )
+      EOSLIB_SERIALIZE( user_resources, (owner)(net_weight)(cpu_weight)(ram_bytes)(self_cpu_weight) )
    };
 
-   // Every user 'from' has a scope/table that uses every receipient 'to' as the primary key.
+   // Every user 'from' has a scope/table that uses every receipient 'to' other than 'from' as the primary key.
    struct [[eosio::table, eosio::contract("eosio.system")]] delegated_bandwidth {
       name          from;
       name          to;
@@ -277,6 +497,16 @@ namespace eosiosystem {
 
    };
 
+   // Reverse of `delband`: every receiver 'to' has a scope/table that uses every delegator 'from' as the primary key.
+   struct [[eosio::table, eosio::contract("eosio.system")]] delegated_from {
+      name          from;
+
+      uint64_t  primary_key()const { return from.value; }
+
+      // explicit serialization macro is not necessary, used here only to improve compilation time
+      EOSLIB_SERIALIZE( delegated_from, (from) )
+   };
+
    struct [[eosio::table, eosio::contract("eosio.system")]] refund_request {
       name            owner;
       time_point_sec  request_time;
@@ -290,9 +520,25 @@ namespace eosiosystem {
       EOSLIB_SERIALIZE( refund_request, (owner)(request_time)(net_amount)(cpu_amount) )
    };
 
+   // Pending refund of `owner`, ordered by request time so that `payrefunds` pays out the matured ones.
+   struct [[eosio::table, eosio::contract("eosio.system")]] refund_queue_entry {
+      name            owner;
+      time_point_sec  request_time;
+
+      uint64_t  primary_key()const { return owner.value; }
+      uint64_t  by_time()const     { return request_time.utc_seconds; }
+
+      // explicit serialization macro is not necessary, used here only to improve compilation time
+      EOSLIB_SERIALIZE( refund_queue_entry, (owner)(request_time) )
+   };
+
    typedef eosio::multi_index< "userres"_n, user_resources >      user_resources_table;
    typedef eosio::multi_index< "delband"_n, delegated_bandwidth > del_bandwidth_table;
+   typedef eosio::multi_index< "delbandrev"_n, delegated_from >   del_bandwidth_rev_table;
    typedef eosio::multi_index< "refunds"_n, refund_request >      refunds_table;
+   typedef eosio::multi_index< "refundq"_n, refund_queue_entry,
+                               indexed_by<"bytime"_n, const_mem_fun<refund_queue_entry, uint64_t, &refund_queue_entry::by_time>  >
+                             > refund_queue_table;
 
 
    /**
@@ -303,14 +549,11 @@ namespace eosiosystem {
       private:
          voters_table            _voters;
          producers_table         _producers;
-         global_state_singleton  _global;
-         global_state2_singleton _global2;
-         global_state3_singleton _global3;
-         eosio_global_state      _gstate;
-         eosio_global_state2     _gstate2;
-         eosio_global_state3     _gstate3;
-         vote_weight_singleton   _vwglobal;
-         vote_weight_state       _vwstate;
+         producer_tally_table    _prodtally;
+         row_cache<producer_tally_table, producer_tally>  _tallies;
+         pending_vote_delta_table _votedelta;
+         lazy_singleton<system_state_singleton, system_state>          _state;
+         lazy_singleton<elected_producers_singleton, elected_producers_state>  _elected;
          account_type_table      _acntype;
          cwl_table               _cwl;
 
@@ -325,6 +568,10 @@ namespace eosiosystem {
          ~system_contract();
 
          static symbol get_core_symbol() {
+            auto _state = system_state_singleton("eosio"_n,"eosio"_n.value);
+            if( _state.exists() ) {
+               return _state.get().global2.core_symbol;
+            }
             auto _global2 = global_state2_singleton("eosio"_n,"eosio"_n.value);
             check( _global2.exists(), "system contract not initialized");
             return _global2.get().core_symbol;
@@ -346,10 +593,22 @@ namespace eosiosystem {
          [[eosio::action]]
          void dlgtcpu( name from, name receiver, asset stake_cpu_quantity, bool transfer );
 
+         [[eosio::action]]
+         void dlgtcpubatch( const name& from, const std::vector<std::pair<name, asset>>& stakes, bool transfer );
+
          [[eosio::action]]
          void undelegatebw( const name& from, const name& receiver,
                             const asset& unstake_net_quantity, const asset& unstake_cpu_quantity );
 
+         [[eosio::action]]
+         void undlgtall( const name& from, uint32_t max_rows );
+
+         [[eosio::action]]
+         void syncdelrev( uint32_t max_rows );
+
+         [[eosio::action]]
+         void foldselfbw( uint32_t max_rows );
+
          [[eosio::action]]
          void undlgtcpu( name from, name receiver, asset unstake_cpu_quantity );
 
@@ -362,15 +621,27 @@ namespace eosiosystem {
          [[eosio::action]]
          void refund( const name& owner );
 
+         [[eosio::action]]
+         void payrefunds( uint32_t max_rows );
+
          [[eosio::action]]
          void regproducer( const name producer, const public_key& producer_key, const std::string& url, uint16_t location );
 
          [[eosio::action]]
          void unregprod( const name producer );
 
+         [[eosio::action]]
+         void migrateprods();
+
+         [[eosio::action]]
+         void regproxy( const name& proxy, bool isproxy );
+
          [[eosio::action]]
          void voteproducer( const name& voter, const name& proxy, const std::vector<name>& producers );
 
+         [[eosio::action]]
+         void migratestate();
+
          [[eosio::action]]
          void setparams( const eosio::blockchain_parameters& params );
 
@@ -383,12 +654,24 @@ namespace eosiosystem {
          [[eosio::action]]
          void setvweight( uint32_t company_weight, uint32_t government_weight );
 
+         [[eosio::action]]
+         void recalcvotes( uint32_t max_rows );
+
+         [[eosio::action]]
+         void setlazyvotes( bool enabled );
+
+         [[eosio::action]]
+         void foldvotes( uint32_t max_rows );
+
          [[eosio::action]]
          void setacntfee( asset account_creation_fee );
 
          [[eosio::action]]
          void awlset( string action, name account );
 
+         [[eosio::action]]
+         void awlsetmany( uint8_t op, const std::vector<name>& accounts );
+
          [[eosio::action]]
          void setcode( name account, uint8_t vmtype, uint8_t vmversion, const std::vector<char>& code );
 
@@ -402,53 +685,97 @@ namespace eosiosystem {
          [[eosio::action]]
          void setacntype( name account, name type );
 
+         [[eosio::action]]
+         void setacntypes( const std::vector<std::pair<name, name>>& types );
+
+         [[eosio::action]]
+         void syncacntype( uint32_t max_rows );
+
          [[eosio::action]]
          void newaccount( const name&       creator,
                           const name&       newact,
                           ignore<authority> owner,
                           ignore<authority> active );
 
+         [[eosio::action]]
+         void newaccounts( const name& creator, const std::vector<new_account_spec>& accounts );
+
          [[eosio::action]]
          void claimrewards( const name& owner );
 
          using init_action = eosio::action_wrapper<"init"_n, &system_contract::init>;
          using delegatebw_action = eosio::action_wrapper<"delegatebw"_n, &system_contract::delegatebw>;
          using dlgtcpu_action = eosio::action_wrapper<"dlgtcpu"_n, &system_contract::dlgtcpu>;
+         using dlgtcpubatch_action = eosio::action_wrapper<"dlgtcpubatch"_n, &system_contract::dlgtcpubatch>;
+         using syncdelrev_action = eosio::action_wrapper<"syncdelrev"_n, &system_contract::syncdelrev>;
+         using foldselfbw_action = eosio::action_wrapper<"foldselfbw"_n, &system_contract::foldselfbw>;
          using undlgtcpu_action = eosio::action_wrapper<"undlgtcpu"_n, &system_contract::undlgtcpu>;
          using undelegatebw_action = eosio::action_wrapper<"undelegatebw"_n, &system_contract::undelegatebw>;
+         using undlgtall_action = eosio::action_wrapper<"undlgtall"_n, &system_contract::undlgtall>;
          using buyram_action = eosio::action_wrapper<"buyram"_n, &system_contract::buyram>;
          using buyrambytes_action = eosio::action_wrapper<"buyrambytes"_n, &system_contract::buyrambytes>;
          using refund_action = eosio::action_wrapper<"refund"_n, &system_contract::refund>;
+         using payrefunds_action = eosio::action_wrapper<"payrefunds"_n, &system_contract::payrefunds>;
          using regproducer_action = eosio::action_wrapper<"regproducer"_n, &system_contract::regproducer>;
          using unregprod_action = eosio::action_wrapper<"unregprod"_n, &system_contract::unregprod>;
+         using migrateprods_action = eosio::action_wrapper<"migrateprods"_n, &system_contract::migrateprods>;
+         using regproxy_action = eosio::action_wrapper<"regproxy"_n, &system_contract::regproxy>;
          using voteproducer_action = eosio::action_wrapper<"voteproducer"_n, &system_contract::voteproducer>;
          using rmvproducer_action = eosio::action_wrapper<"rmvproducer"_n, &system_contract::rmvproducer>;
          using updtrevision_action = eosio::action_wrapper<"updtrevision"_n, &system_contract::updtrevision>;
          using setpriv_action = eosio::action_wrapper<"setpriv"_n, &system_contract::setpriv>;
          using setalimits_action = eosio::action_wrapper<"setalimits"_n, &system_contract::setalimits>;
+         using migratestate_action = eosio::action_wrapper<"migratestate"_n, &system_contract::migratestate>;
          using setparams_action = eosio::action_wrapper<"setparams"_n, &system_contract::setparams>;
          using claimrewards_action = eosio::action_wrapper<"claimrewards"_n, &system_contract::claimrewards>;
 
          using setgrtdcpu_action = eosio::action_wrapper<"setgrtdcpu"_n, &system_contract::setgrtdcpu>;
          using setvweight_action = eosio::action_wrapper<"setvweight"_n, &system_contract::setvweight>;
+         using recalcvotes_action = eosio::action_wrapper<"recalcvotes"_n, &system_contract::recalcvotes>;
+         using setlazyvotes_action = eosio::action_wrapper<"setlazyvotes"_n, &system_contract::setlazyvotes>;
+         using foldvotes_action = eosio::action_wrapper<"foldvotes"_n, &system_contract::foldvotes>;
          using setacntfee_action = eosio::action_wrapper<"setacntfee"_n, &system_contract::setacntfee>;
          using awlset_action = eosio::action_wrapper<"awlset"_n, &system_contract::awlset>;
+         using awlsetmany_action = eosio::action_wrapper<"awlsetmany"_n, &system_contract::awlsetmany>;
          using setcode_action = eosio::action_wrapper<"setcode"_n, &system_contract::setcode>;
          using setacntype_action = eosio::action_wrapper<"setacntype"_n, &system_contract::setacntype>;
+         using setacntypes_action = eosio::action_wrapper<"setacntypes"_n, &system_contract::setacntypes>;
+         using syncacntype_action = eosio::action_wrapper<"syncacntype"_n, &system_contract::syncacntype>;
          using newaccount_action = eosio::action_wrapper<"newaccount"_n, &system_contract::newaccount>;
+         using newaccounts_action = eosio::action_wrapper<"newaccounts"_n, &system_contract::newaccounts>;
 
       private:
          //defined in eosio.system.cpp
          static eosio_global_state  get_default_parameters();
-         symbol core_symbol()const;
+         static system_state        get_legacy_state();
+         symbol core_symbol();
+         std::optional<uint64_t> get_cursor( const name& job )const;
+         void set_cursor( const name& job, const std::optional<uint64_t>& next );
+         name voter_account_type( const voter_info& voter )const;
+         void set_account_type( const name& account, const name& type );
+         void update_white_list( cwl_operation op, const name& account );
 
          //defined in delegate_bandwidth.cpp
          void changebw( name from, const name& receiver,const asset& stake_cpu_quantity, bool transfer );
+         void update_delband( const name& from, const name& receiver, const asset& stake_cpu_delta );
+         void update_userres( const name& from, const name& receiver, const asset& stake_cpu_delta );
+         int64_t fold_self_delband( const name& owner );
+         asset update_refund( const name& from, const asset& stake_cpu_delta, bool is_delegating_to_self );
          void update_voting_power( const name& voter, const asset& total_update );
+         void update_refund_queue( const name& owner, const std::optional<time_point_sec>& request_time );
 
          //defined in voting.cpp
          void update_elected_producers( const block_timestamp& timestamp );
-         void update_producers_votes( name type, bool voting, const std::vector<name>& old_producers, int64_t old_staked,
+         const producer_tally& get_tally( const name& producer, const name& payer );
+         void note_vote_change( const producer_tally& tally, uint128_t old_weight );
+         void invalidate_elected( const name& producer );
+         bool recalc_vote_weights( uint32_t max_rows );
+         bool fold_vote_deltas( uint32_t max_rows );
+         void queue_vote_deltas( const name& voter, const std::vector<vote_delta>& deltas );
+         bool fold_proxy_weights( uint32_t max_rows );
+         void add_proxied_weight( const name& proxy, int64_t delta );
+         void apply_vote_delta( const name& producer, int64_t company_delta, int64_t government_delta );
+         void update_producers_votes( const name& voter, name type, bool voting, const std::vector<name>& old_producers, int64_t old_staked,
                                       const std::vector<name>& new_producers, int64_t new_staked );
    };
 
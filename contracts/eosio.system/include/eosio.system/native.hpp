@@ -126,6 +126,8 @@ namespace eosiosystem {
       EOSLIB_SERIALIZE( abi_hash, (owner)(hash) )
    };
 
+   typedef eosio::multi_index< "abihash"_n, abi_hash >  abi_hash_table;
+
    // Method parameters commented out to prevent generation of code that parses input data.
    /**
     * The EOSIO core native contract that governs authorization and contracts' abi.
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <eosio/check.hpp>
+#include <eosio/multi_index.hpp>
+
+#include <map>
+
+namespace eosiosystem {
+
+   /**
+    * Action-scoped write-back cache over the rows of a `multi_index` table: `modify` changes a cached copy
+    * of the row and `flush` writes each changed row back with a single `db_update`, however many times it
+    * was modified. While the cache is in use, cached rows must not be modified through the table itself,
+    * and scans of the table or its secondary indices must be preceded by `flush`.
+    */
+   template<typename Table, typename T>
+   class row_cache {
+      public:
+         explicit row_cache( Table& tbl ) :_tbl(tbl) {}
+
+         const T* find( uint64_t pk ) {
+            auto itr = _rows.find( pk );
+            if( itr == _rows.end() ) {
+               auto row = _tbl.find( pk );
+               if( row == _tbl.end() ) {
+                  return nullptr;
+               }
+               itr = _rows.emplace( pk, entry{ *row, false } ).first;
+            }
+            return &itr->second.row;
+         }
+
+         const T& get( uint64_t pk, const char* error_msg = "unable to find key" ) {
+            const T* row = find( pk );
+            eosio::check( row != nullptr, error_msg );
+            return *row;
+         }
+
+         template<typename Lambda>
+         const T& modify( uint64_t pk, Lambda&& updater ) {
+            get( pk );
+            auto& e = _rows.find( pk )->second;
+            updater( e.row );
+            e.dirty = true;
+            return e.row;
+         }
+
+         void flush() {
+            for( auto& [pk, e] : _rows ) {
+               if( e.dirty ) {
+                  _tbl.modify( _tbl.get( pk ), eosio::same_payer, [&]( T& row ) {
+                     row = e.row;
+                  });
+                  e.dirty = false;
+               }
+            }
+         }
+
+      private:
+         struct entry {
+            T     row;
+            bool  dirty = false;
+         };
+
+         Table&                      _tbl;
+         std::map<uint64_t, entry>   _rows;
+   };
+
+}
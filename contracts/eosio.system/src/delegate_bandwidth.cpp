@@ -3,7 +3,6 @@
 #include <eosio/multi_index.hpp>
 #include <eosio/privileged.hpp>
 #include <eosio/serialize.hpp>
-#include <eosio/transaction.hpp>
 
 #include <eosio.system/eosio.system.hpp>
 #include <eosio.token/eosio.token.hpp>
@@ -19,6 +18,17 @@ namespace eosiosystem {
    using eosio::time_point_sec;
    using eosio::token;
 
+   // Balance row of the token contract, read to know whether a refund transfer has to create it.
+   struct token_balance {
+      asset    balance;
+
+      uint64_t primary_key()const { return balance.symbol.code().raw(); }
+
+      EOSLIB_SERIALIZE( token_balance, (balance) )
+   };
+
+   typedef eosio::multi_index< "accounts"_n, token_balance > token_balances_table;
+
    void system_contract::buyrambytes( const name& payer, const name& receiver, uint32_t bytes ) {
       check( bytes == 0, "buyrambytes action's bytes must be zero ");
    }
@@ -38,123 +48,307 @@ namespace eosiosystem {
          from = receiver;
       }
 
-      // update stake delegated from "from" to "receiver"
-      {
-         del_bandwidth_table     del_tbl( _self, from.value );
-         auto itr = del_tbl.find( receiver.value );
-         if( itr == del_tbl.end() ) {
-            itr = del_tbl.emplace( from, [&]( auto& dbo ){
-                  dbo.from          = from;
-                  dbo.to            = receiver;
-                  dbo.cpu_weight    = stake_cpu_delta;
-            });
-         } else {
-            del_tbl.modify( itr, same_payer, [&]( auto& dbo ){
-                  dbo.cpu_weight    += stake_cpu_delta;
-            });
-         }
+      update_delband( from, receiver, stake_cpu_delta );
+      update_userres( from, receiver, stake_cpu_delta );
 
-         check( 0 <= itr->cpu_weight.amount, "insufficient staked cpu bandwidth" );
-         if ( itr->is_empty() ) {
-            del_tbl.erase( itr );
+      // create refund or update from existing refund
+      if ( stake_account != source_stake_from ) { //for eosio both transfer and refund make no sense
+         auto transfer_amount = update_refund( from, stake_cpu_delta, !transfer && from == receiver );
+         if ( 0 < transfer_amount.amount ) {
+            token::transfer_action transfer_act{ token_account, { {source_stake_from, active_permission} } };
+            transfer_act.send( source_stake_from, stake_account, asset(transfer_amount), "stake bandwidth" );
          }
-      } // itr can be invalid, should go out of scope
-
-      // update totals of "receiver"
-      {
-         user_resources_table   totals_tbl( _self, receiver.value );
-         auto tot_itr = totals_tbl.find( receiver.value );
-         if( tot_itr ==  totals_tbl.end() ) {
-            tot_itr = totals_tbl.emplace( from, [&]( auto& tot ) {
-                  tot.owner      = receiver;
-                  tot.cpu_weight = stake_cpu_delta;
-            });
-         } else {
-            totals_tbl.modify( tot_itr, from == receiver ? from : same_payer, [&]( auto& tot ) {
-                  tot.cpu_weight += stake_cpu_delta;
-            });
+      }
+
+      update_voting_power( from, stake_cpu_delta );
+   }
+
+   // update stake delegated from "from" to "receiver"
+   void system_contract::update_delband( const name& from, const name& receiver, const asset& stake_cpu_delta )
+   {
+      if ( from == receiver ) {
+         return; // self stake is kept in user_resources::self_cpu_weight by update_userres
+      }
+
+      del_bandwidth_table     del_tbl( _self, from.value );
+      del_bandwidth_rev_table rev_tbl( _self, receiver.value );
+      auto itr = del_tbl.find( receiver.value );
+      if( itr == del_tbl.end() ) {
+         itr = del_tbl.emplace( from, [&]( auto& dbo ){
+               dbo.from          = from;
+               dbo.to            = receiver;
+               dbo.cpu_weight    = stake_cpu_delta;
+         });
+         rev_tbl.emplace( from, [&]( auto& rev ){
+               rev.from          = from;
+         });
+      } else {
+         del_tbl.modify( itr, same_payer, [&]( auto& dbo ){
+               dbo.cpu_weight    += stake_cpu_delta;
+         });
+      }
+
+      check( 0 <= itr->cpu_weight.amount, "insufficient staked cpu bandwidth" );
+      if ( itr->is_empty() ) {
+         del_tbl.erase( itr );
+         auto rev_itr = rev_tbl.find( from.value );
+         if ( rev_itr != rev_tbl.end() ) { // delegations made before delbandrev existed may not have one
+            rev_tbl.erase( rev_itr );
          }
+      }
+   }
+
+   /**
+    *  Removes the `delband` row of `owner` to itself, written before self stake moved into
+    *  user_resources::self_cpu_weight, and returns its cpu amount.
+    */
+   int64_t system_contract::fold_self_delband( const name& owner )
+   {
+      del_bandwidth_table del_tbl( _self, owner.value );
+      auto itr = del_tbl.find( owner.value );
+      if ( itr == del_tbl.end() ) {
+         return 0;
+      }
+      const int64_t amount = itr->cpu_weight.amount;
+      del_tbl.erase( itr );
+
+      del_bandwidth_rev_table rev_tbl( _self, owner.value );
+      auto rev_itr = rev_tbl.find( owner.value );
+      if ( rev_itr != rev_tbl.end() ) {
+         rev_tbl.erase( rev_itr );
+      }
+      return amount;
+   }
 
-         check( 0 <= tot_itr->cpu_weight.amount, "insufficient staked total cpu bandwidth" );
-         set_resource_limits_cpu( receiver, tot_itr->cpu_weight.amount );
-         if ( tot_itr->is_empty() ) {
-            totals_tbl.erase( tot_itr );
+   /**
+    *  Moves the self stake of at most `max_rows` voters from their `delband` row to self into
+    *  user_resources::self_cpu_weight, resuming from the `foldselfbw` cursor. Every account with
+    *  self stake has a `voters` row; other `userres` rows are marked on their next stake change.
+    */
+   void system_contract::foldselfbw( uint32_t max_rows ) {
+      require_auth( get_self() );
+      check( 0 < max_rows, "max_rows must be positive" );
+
+      static constexpr name job = "foldselfbw"_n;
+      auto voter_itr = _voters.lower_bound( get_cursor( job ).value_or( 0 ) );
+      for( ; voter_itr != _voters.end() && 0 < max_rows; ++voter_itr, --max_rows ) {
+         const name owner = voter_itr->owner;
+         user_resources_table totals_tbl( _self, owner.value );
+         auto tot_itr = totals_tbl.find( owner.value );
+         if ( tot_itr == totals_tbl.end() || tot_itr->self_cpu_weight.has_value() ) {
+            continue;
          }
-      } // tot_itr can be invalid, should go out of scope
+         const int64_t folded = fold_self_delband( owner );
+         totals_tbl.modify( tot_itr, same_payer, [&]( auto& tot ) {
+            tot.self_cpu_weight.emplace( folded, tot.cpu_weight.symbol );
+         });
+      }
 
-      // create refund or update from existing refund
-      if ( stake_account != source_stake_from ) { //for eosio both transfer and refund make no sense
-         refunds_table refunds_tbl( _self, from.value );
-         auto req = refunds_tbl.find( from.value );
-
-         //create/update/delete refund
-         auto cpu_balance = stake_cpu_delta;
-         bool need_deferred_trx = false;
-
-         // redundant assertion also at start of changebw to protect against misuse of changebw
-         bool is_undelegating = cpu_balance.amount < 0;
-         bool is_delegating_to_self = (!transfer && from == receiver);
-
-         if( is_delegating_to_self || is_undelegating ) {
-            if ( req != refunds_tbl.end() ) { //need to update refund
-               refunds_tbl.modify( req, same_payer, [&]( refund_request& r ) {
-                  if ( cpu_balance.amount < 0 ) {
-                     r.request_time = current_time_point();
-                  }
-
-                  r.cpu_amount -= cpu_balance;
-
-                  if ( r.cpu_amount.amount < 0 ){
-                     r.cpu_amount.amount = 0;
-                     cpu_balance = -r.cpu_amount;
-                  } else {
-                     cpu_balance.amount = 0;
-                  }
+      set_cursor( job, voter_itr == _voters.end() ? std::optional<uint64_t>() : voter_itr->owner.value );
+   }
+
+   /**
+    *  Creates the missing `delbandrev` rows of delegations made before the table existed. Every account
+    *  with a `delband` scope has a `voters` row, so the walk follows `voters`. It handles at most `max_rows`
+    *  `delband` rows per call, a delegator without any counting as one, and resumes from the `syncdelrev`
+    *  cursor (the delegator) and the `syncdelrevto` cursor (the receiver within its scope).
+    */
+   void system_contract::syncdelrev( uint32_t max_rows ) {
+      require_auth( get_self() );
+      check( 0 < max_rows, "max_rows must be positive" );
+
+      static constexpr name job       = "syncdelrev"_n;
+      static constexpr name inner_job = "syncdelrevto"_n;
+      auto voter_itr = _voters.lower_bound( get_cursor( job ).value_or( 0 ) );
+      uint64_t next_to = get_cursor( inner_job ).value_or( 0 );
+      std::optional<uint64_t> resume_to;
+      for( ; voter_itr != _voters.end() && 0 < max_rows; ++voter_itr ) {
+         del_bandwidth_table del_tbl( _self, voter_itr->owner.value );
+         auto dbo = del_tbl.lower_bound( next_to );
+         next_to = 0;
+         if( dbo == del_tbl.end() ) {
+            --max_rows;
+            continue;
+         }
+         for( ; dbo != del_tbl.end() && 0 < max_rows; ++dbo, --max_rows ) {
+            del_bandwidth_rev_table rev_tbl( _self, dbo->to.value );
+            if ( rev_tbl.find( dbo->from.value ) == rev_tbl.end() ) {
+               rev_tbl.emplace( get_self(), [&]( auto& rev ){
+                  rev.from = dbo->from;
                });
+            }
+         }
+         if( dbo != del_tbl.end() ) {
+            resume_to = dbo->to.value;
+            break;
+         }
+      }
 
-               check( 0 <= req->cpu_amount.amount, "negative cpu refund amount" ); //should never happen
+      set_cursor( job, voter_itr == _voters.end() ? std::optional<uint64_t>() : voter_itr->owner.value );
+      set_cursor( inner_job, resume_to );
+   }
 
-               if ( req->is_empty() ) {
-                  refunds_tbl.erase( req );
-                  need_deferred_trx = false;
-               } else {
-                  need_deferred_trx = true;
+   // update totals of "receiver"
+   void system_contract::update_userres( const name& from, const name& receiver, const asset& stake_cpu_delta )
+   {
+      user_resources_table   totals_tbl( _self, receiver.value );
+      auto tot_itr = totals_tbl.find( receiver.value );
+      const int64_t self_delta = from == receiver ? stake_cpu_delta.amount : 0;
+      if( tot_itr ==  totals_tbl.end() ) {
+         tot_itr = totals_tbl.emplace( from, [&]( auto& tot ) {
+               tot.owner      = receiver;
+               tot.cpu_weight = stake_cpu_delta;
+               tot.self_cpu_weight.emplace( self_delta, stake_cpu_delta.symbol );
+         });
+      } else {
+         const int64_t folded = tot_itr->self_cpu_weight.has_value() ? 0 : fold_self_delband( receiver );
+         totals_tbl.modify( tot_itr, from == receiver ? from : same_payer, [&]( auto& tot ) {
+               tot.cpu_weight += stake_cpu_delta;
+               tot.self_cpu_weight.emplace( tot.self_stake().amount + folded + self_delta, tot.cpu_weight.symbol );
+         });
+      }
+
+      check( 0 <= tot_itr->self_stake().amount, "insufficient staked cpu bandwidth" );
+      check( 0 <= tot_itr->cpu_weight.amount, "insufficient staked total cpu bandwidth" );
+      set_resource_limits_cpu( receiver, tot_itr->cpu_weight.amount );
+      if ( tot_itr->is_empty() ) {
+         totals_tbl.erase( tot_itr );
+      }
+   }
+
+   /**
+    *  Stake increases delegated to self are first taken from a pending refund of `from`, unstaked
+    *  tokens are added to it. Returns the part of `stake_cpu_delta` that still has to be transferred
+    *  to the stake account.
+    */
+   asset system_contract::update_refund( const name& from, const asset& stake_cpu_delta, bool is_delegating_to_self )
+   {
+      refunds_table refunds_tbl( _self, from.value );
+      auto req = refunds_tbl.find( from.value );
+
+      //create/update/delete refund
+      auto cpu_balance = stake_cpu_delta;
+      bool refund_changed = false;
+      std::optional<time_point_sec> refund_time;
+
+      // redundant assertion also at start of changebw to protect against misuse of changebw
+      bool is_undelegating = cpu_balance.amount < 0;
+
+      if( is_delegating_to_self || is_undelegating ) {
+         if ( req != refunds_tbl.end() ) { //need to update refund
+            refunds_tbl.modify( req, same_payer, [&]( refund_request& r ) {
+               if ( cpu_balance.amount < 0 ) {
+                  r.request_time = current_time_point();
                }
-            } else if ( cpu_balance.amount < 0 ) { //need to create refund
-               refunds_tbl.emplace( from, [&]( refund_request& r ) {
-                  r.owner = from;
-                  r.cpu_amount = -cpu_balance;
+
+               r.cpu_amount -= cpu_balance;
+
+               if ( r.cpu_amount.amount < 0 ){
+                  cpu_balance = -r.cpu_amount;
+                  r.cpu_amount.amount = 0;
+               } else {
                   cpu_balance.amount = 0;
-                  r.request_time = current_time_point();
-               });
-               need_deferred_trx = true;
-            } // else stake increase requested with no existing row in refunds_tbl -> nothing to do with refunds_tbl
-         } /// end if is_delegating_to_self || is_undelegating
-
-         if ( need_deferred_trx ) {
-            eosio::transaction out;
-            out.actions.emplace_back( permission_level{from, active_permission},  _self, "refund"_n,  from );
-            out.delay_sec = refund_delay_sec;
-            eosio::cancel_deferred( from.value );
-            out.send( from.value, from, true );
-         } else {
-            eosio::cancel_deferred( from.value );
-         }
+               }
+            });
 
-         auto transfer_amount = cpu_balance;
-         if ( 0 < transfer_amount.amount ) {
-            token::transfer_action transfer_act{ token_account, { {source_stake_from, active_permission} } };
-            transfer_act.send( source_stake_from, stake_account, asset(transfer_amount), "stake bandwidth" );
+            check( 0 <= req->cpu_amount.amount, "negative cpu refund amount" ); //should never happen
+
+            refund_changed = true;
+            if ( req->is_empty() ) {
+               refunds_tbl.erase( req );
+            } else {
+               refund_time = req->request_time;
+            }
+         } else if ( cpu_balance.amount < 0 ) { //need to create refund
+            auto new_req = refunds_tbl.emplace( from, [&]( refund_request& r ) {
+               r.owner = from;
+               r.cpu_amount = -cpu_balance;
+               cpu_balance.amount = 0;
+               r.request_time = current_time_point();
+            });
+            refund_changed = true;
+            refund_time = new_req->request_time;
+         } // else stake increase requested with no existing row in refunds_tbl -> nothing to do with refunds_tbl
+      } /// end if is_delegating_to_self || is_undelegating
+
+      if ( refund_changed ) {
+         update_refund_queue( from, refund_time );
+      }
+
+      return cpu_balance;
+   }
+
+   /**
+    *  Keeps the `refundq` entry of `owner` in line with its refund request: the entry is removed when
+    *  `request_time` is empty and otherwise (re)scheduled at `request_time`.
+    */
+   void system_contract::update_refund_queue( const name& owner, const std::optional<time_point_sec>& request_time ) {
+      refund_queue_table queue( get_self(), get_self().value );
+      auto itr = queue.find( owner.value );
+      if ( !request_time ) {
+         if ( itr != queue.end() ) {
+            queue.erase( itr );
          }
+      } else if ( itr == queue.end() ) {
+         queue.emplace( owner, [&]( auto& q ) {
+            q.owner        = owner;
+            q.request_time = *request_time;
+         });
+      } else if ( itr->request_time != *request_time ) {
+         queue.modify( itr, same_payer, [&]( auto& q ) {
+            q.request_time = *request_time;
+         });
       }
+   }
 
-      update_voting_power( from, stake_cpu_delta );
+   /**
+    *  Pays out at most `max_rows` refunds whose delay has passed, oldest first. Any account can call it,
+    *  a failing transfer only fails this call. The transfer is authorized by `eosio.stake` alone, so the
+    *  token contract would bill it the RAM of a balance row it has to create: owners without a balance
+    *  row are dropped from the queue. So are accounts that may carry code and reject the transfer
+    *  notification, which would otherwise fail every call at the head of the queue: accounts whitelisted
+    *  for contracts (see setcode) and accounts that have set an abi, which covers contracts whose owner
+    *  was removed from the whitelist afterwards. They pull their refund with the `refund` action.
+    */
+   void system_contract::payrefunds( uint32_t max_rows ) {
+      check( 0 < max_rows, "max_rows must be positive" );
+
+      refund_queue_table queue( get_self(), get_self().value );
+      abi_hash_table     abi_hashes( get_self(), get_self().value );
+      auto idx = queue.get_index<"bytime"_n>();
+      const auto now = current_time_point();
+
+      for ( auto it = idx.begin(); it != idx.end() && 0 < max_rows && it->request_time + seconds(refund_delay_sec) <= now; --max_rows ) {
+         const name owner = it->owner;
+         it = idx.erase( it );
+
+         if ( owner == get_self() || owner == token_account || owner == "eosio.msig"_n || _cwl.find( owner.value ) != _cwl.end() ) {
+            continue;
+         }
+         if ( abi_hashes.find( owner.value ) != abi_hashes.end() ) {
+            continue;
+         }
+
+         refunds_table refunds_tbl( get_self(), owner.value );
+         auto req = refunds_tbl.find( owner.value );
+         if ( req == refunds_tbl.end() ) {
+            continue;
+         }
+         token_balances_table balances( token_account, owner.value );
+         if ( balances.find( req->cpu_amount.symbol.code().raw() ) == balances.end() ) {
+            continue;
+         }
+         token::transfer_action transfer_act{ token_account, { {stake_account, active_permission} } };
+         transfer_act.send( stake_account, req->owner, req->cpu_amount, "unstake" );
+         refunds_tbl.erase( req );
+      }
    }
 
    void system_contract::update_voting_power( const name& voter, const asset& total_update )
    {
       int64_t old_staked = 0;
       int64_t new_staked = 0;
+      name    a_type;
 
       auto voter_itr = _voters.find( voter.value );
       if( voter_itr == _voters.end() ) {
@@ -165,20 +359,24 @@ namespace eosiosystem {
          old_staked = 0;
          new_staked = voter_itr->staked;
       } else {
-         old_staked = voter_itr->staked;
+         old_staked = voter_itr->applied_vote_weight();
+         a_type = voter_itr->producers.size() ? voter_account_type( *voter_itr ) : voter_itr->account_type();
          _voters.modify( voter_itr, same_payer, [&]( auto& v ) {
             v.staked += total_update.amount;
+            v.set_account_type( a_type );
+            if( v.is_proxy ) {
+               v.last_vote_weight = v.vote_weight();
+            }
          });
-         new_staked = voter_itr->staked;
+         new_staked = voter_itr->applied_vote_weight();
       }
 
       check( 0 <= voter_itr->staked, "stake for voting cannot be negative" );
 
-      if( voter_itr->producers.size() ) {
-          auto itr = _acntype.find( voter.value );
-          if( itr != _acntype.end() ){
-             update_producers_votes( itr->type , false, voter_itr->producers, old_staked, voter_itr->producers, new_staked);
-          }
+      if( voter_itr->proxy ) {
+         add_proxied_weight( voter_itr->proxy, total_update.amount );
+      } else if( voter_itr->producers.size() && a_type != name() ) {
+         update_producers_votes( voter, a_type, false, voter_itr->producers, old_staked, voter_itr->producers, new_staked );
       }
    }
 
@@ -199,6 +397,48 @@ namespace eosiosystem {
       delegatebw( from, receiver, zero_asset, stake_cpu_quantity, transfer );
    }
 
+   /**
+    *  Stakes cpu from `from` to every receiver of `stakes` in one pass: one authorization check, one
+    *  stake transfer for the sum and, unless `transfer` is set, one voting power update for `from`.
+    */
+   void system_contract::dlgtcpubatch( const name& from, const std::vector<std::pair<name, asset>>& stakes, bool transfer ) {
+      require_auth( from );
+      check( !stakes.empty(), "stakes must not be empty" );
+
+      const asset zero_asset( 0, core_symbol() );
+      asset total = zero_asset;
+      asset self_stake = zero_asset;
+      for( const auto& [receiver, quantity] : stakes ) {
+         check( quantity > zero_asset, "must stake a positive amount" );
+         check( !transfer || from != receiver, "cannot use transfer flag if delegating to self" );
+
+         const name owner = transfer ? receiver : from;
+         update_delband( owner, receiver, quantity );
+         update_userres( owner, receiver, quantity );
+         if ( transfer ) {
+            update_voting_power( receiver, quantity );
+         } else if ( receiver == from ) {
+            self_stake += quantity;
+         }
+         total += quantity;
+      }
+
+      if ( stake_account != from ) {
+         auto transfer_amount = total;
+         if ( 0 < self_stake.amount ) {
+            transfer_amount = total - self_stake + update_refund( from, self_stake, true );
+         }
+         if ( 0 < transfer_amount.amount ) {
+            token::transfer_action transfer_act{ token_account, { {from, active_permission} } };
+            transfer_act.send( from, stake_account, transfer_amount, "stake bandwidth" );
+         }
+      }
+
+      if ( !transfer ) {
+         update_voting_power( from, total );
+      }
+   }
+
    void system_contract::undelegatebw( const name& from, const name& receiver,
                                        const asset& unstake_net_quantity, const asset& unstake_cpu_quantity ){
       asset zero_asset( 0, core_symbol() );
@@ -209,6 +449,42 @@ namespace eosiosystem {
       changebw( from, receiver, -unstake_cpu_quantity, false);
    } // undelegatebw
 
+   /**
+    *  Unstakes everything `from` delegated to at most `max_rows` receivers, and its self stake once no
+    *  delegation is left, with a single refund update and voting power update. Fully undelegated `delband`
+    *  rows are erased, so the next call resumes with the receivers that are left.
+    */
+   void system_contract::undlgtall( const name& from, uint32_t max_rows ) {
+      require_auth( from );
+      check( 0 < max_rows, "max_rows must be positive" );
+
+      asset total( 0, core_symbol() );
+      del_bandwidth_table del_tbl( _self, from.value );
+      for( auto itr = del_tbl.begin(); itr != del_tbl.end() && 0 < max_rows; itr = del_tbl.begin(), --max_rows ) {
+         const name  receiver = itr->to;
+         const asset amount   = itr->cpu_weight;
+         update_delband( from, receiver, -amount );
+         update_userres( from, receiver, -amount ); // also folds a `delband` row to self, see update_userres
+         total += amount;
+      }
+
+      if( del_tbl.begin() == del_tbl.end() && 0 < max_rows ) {
+         user_resources_table totals_tbl( _self, from.value );
+         auto tot_itr = totals_tbl.find( from.value );
+         if( tot_itr != totals_tbl.end() && 0 < tot_itr->self_stake().amount ) {
+            const asset self_stake = tot_itr->self_stake();
+            update_userres( from, from, -self_stake );
+            total += self_stake;
+         }
+      }
+
+      check( 0 < total.amount, "no staked cpu bandwidth to undelegate" );
+      if ( stake_account != from ) {
+         update_refund( from, -total, false );
+      }
+      update_voting_power( from, -total );
+   }
+
    void system_contract::undlgtcpu( name from, name receiver, asset unstake_cpu_quantity ){
       asset zero_asset( 0, core_symbol() );
       undelegatebw( from, receiver, zero_asset, unstake_cpu_quantity );
@@ -224,6 +500,7 @@ namespace eosiosystem {
       token::transfer_action transfer_act{ token_account, { {stake_account, active_permission}, {req->owner, active_permission} } };
       transfer_act.send( stake_account, req->owner, req->cpu_amount, "unstake" );
       refunds_tbl.erase( req );
+      update_refund_queue( owner, {} );
    }
 
 
@@ -19,18 +19,15 @@ namespace eosiosystem {
    :native(s,code,ds),
     _voters(get_self(), get_self().value),
     _producers(get_self(), get_self().value),
-    _global(get_self(), get_self().value),
-    _global2(get_self(), get_self().value),
-    _global3(get_self(), get_self().value),
-    _vwglobal(_self, _self.value),
+    _prodtally(get_self(), get_self().value),
+    _tallies(_prodtally),
+    _votedelta(get_self(), get_self().value),
+    _state(get_self(), get_self().value, &system_contract::get_legacy_state),
+    _elected(_self, _self.value),
     _acntype(_self, _self.value),
     _cwl(_self, _self.value)
    {
       //print( "construct system\n" );
-      _gstate  = _global.exists() ? _global.get() : get_default_parameters();
-      _gstate2 = _global2.exists() ? _global2.get() : eosio_global_state2{};
-      _gstate3 = _global3.exists() ? _global3.get() : eosio_global_state3{};
-      _vwstate = _vwglobal.exists() ? _vwglobal.get() : vote_weight_state{};
    }
 
    eosio_global_state system_contract::get_default_parameters() {
@@ -39,21 +36,89 @@ namespace eosiosystem {
       return dp;
    }
 
-   symbol system_contract::core_symbol()const {
-      return _gstate2.core_symbol;
+   /**
+    *  Assembles the state from the singletons `state` replaced, for chains where it has not been
+    *  written yet. The first modification writes the `state` row, `migratestate` also removes the old rows.
+    */
+   system_state system_contract::get_legacy_state() {
+      global_state_singleton  global( "eosio"_n, "eosio"_n.value );
+      global_state2_singleton global2( "eosio"_n, "eosio"_n.value );
+      global_state3_singleton global3( "eosio"_n, "eosio"_n.value );
+      vote_weight_singleton   vote_weight( "eosio"_n, "eosio"_n.value );
+
+      system_state state;
+      state.global      = global.exists() ? global.get() : get_default_parameters();
+      state.global2     = global2.get_or_default();
+      state.global3     = global3.get_or_default();
+      state.vote_weight = vote_weight.get_or_default();
+      return state;
+   }
+
+   symbol system_contract::core_symbol() {
+      return _state.get().global2.core_symbol;
+   }
+
+   std::optional<uint64_t> system_contract::get_cursor( const name& job )const {
+      batch_cursor_table cursors( get_self(), get_self().value );
+      auto itr = cursors.find( job.value );
+      if( itr == cursors.end() ) {
+         return {};
+      }
+      return itr->next;
+   }
+
+   void system_contract::set_cursor( const name& job, const std::optional<uint64_t>& next ) {
+      batch_cursor_table cursors( get_self(), get_self().value );
+      auto itr = cursors.find( job.value );
+      if( !next ) {
+         if( itr != cursors.end() ) {
+            cursors.erase( itr );
+         }
+      } else if( itr == cursors.end() ) {
+         cursors.emplace( get_self(), [&]( auto& c ) {
+            c.job  = job;
+            c.next = *next;
+         });
+      } else {
+         cursors.modify( itr, same_payer, [&]( auto& c ) {
+            c.next = *next;
+         });
+      }
+   }
+
+   name system_contract::voter_account_type( const voter_info& voter )const {
+      auto type = voter.account_type();
+      if( type == name() ) { // voters written before the type was cached in voter_info
+         auto itr = _acntype.find( voter.owner.value );
+         if( itr != _acntype.end() ) {
+            type = itr->type;
+         }
+      }
+      return type;
    }
 
    system_contract::~system_contract() {
-      _global.set( _gstate, get_self() );
-      _global2.set( _gstate2, get_self() );
-      _global3.set( _gstate3, get_self() );
-      _vwglobal.set( _vwstate, _self );
+      _tallies.flush();
+      _state.flush( get_self() );
+      _elected.flush( _self );
+   }
+
+   void system_contract::migratestate() {
+      require_auth( get_self() );
+
+      _state.modify().version = system_state().version;
+
+      global_state_singleton( get_self(), get_self().value ).remove();
+      global_state2_singleton( get_self(), get_self().value ).remove();
+      global_state3_singleton( get_self(), get_self().value ).remove();
+      vote_weight_singleton( get_self(), get_self().value ).remove();
    }
 
    void system_contract::setparams( const eosio::blockchain_parameters& params ) {
       require_auth( get_self() );
-      (eosio::blockchain_parameters&)(_gstate) = params;
-      check( 3 <= _gstate.max_authority_depth, "max_authority_depth should be at least 3" );
+      auto& gstate = _state.modify().global;
+      (eosio::blockchain_parameters&)(gstate) = params;
+      check( 3 <= gstate.max_authority_depth, "max_authority_depth should be at least 3" );
       set_blockchain_parameters( params );
    }
 
@@ -63,8 +128,8 @@ namespace eosiosystem {
       const static uint32_t max_microsec = 60 * 1000 * 1000; // 60 seconds
 
       check( cpu <= max_microsec , "the value of cpu should not more then 60 seconds");
-      check( cpu > _gstate2.guaranteed_cpu, "can not reduce cpu guarantee");
-      _gstate2.guaranteed_cpu = cpu;
+      check( cpu > _state.get().global2.guaranteed_cpu, "can not reduce cpu guarantee");
+      _state.modify().global2.guaranteed_cpu = cpu;
 
       // set_guaranteed_minimum_resources(0, cpu, 0);
    }
@@ -91,15 +156,20 @@ namespace eosiosystem {
       _producers.modify( prod, same_payer, [&](auto& p) {
             p.deactivate();
          });
+      get_tally( producer, get_self() );
+      _tallies.modify( producer.value, [&](auto& t) {
+            t.is_active = false;
+         });
+      invalidate_elected( producer );
    }
 
    void system_contract::updtrevision( uint8_t revision ) {
       require_auth( get_self() );
-      check( _gstate2.revision < 255, "can not increment revision" ); // prevent wrap around
-      check( revision == _gstate2.revision + 1, "can only increment revision by one" );
+      check( _state.get().global2.revision < 255, "can not increment revision" ); // prevent wrap around
+      check( revision == _state.get().global2.revision + 1, "can only increment revision by one" );
       check( revision <= 1, // set upper bound to greatest revision supported in the code
              "specified revision is not yet supported by the code" );
-      _gstate2.revision = revision;
+      _state.modify().global2.revision = revision;
    }
 
    /**
@@ -116,6 +186,7 @@ namespace eosiosystem {
                                      ignore<authority> owner,
                                      ignore<authority> active ) {
 
+      std::optional<symbol> core;
       if( creator != get_self() ) {
          uint64_t tmp = newact.value >> 4;
          bool has_dot = false;
@@ -130,24 +201,77 @@ namespace eosiosystem {
             check( creator == suffix, "only suffix may create this account" );
          }
 
-         check( _gstate2.account_creation_fee.amount > 0, "account_creation_fee must set first" );
-         transfer_action_type action_data{ creator, saving_account, _gstate2.account_creation_fee, "new account creation fee" };
-         eosio::action( permission_level{ creator, "active"_n }, token_account, "transfer"_n, action_data ).send();
+         account_credit_table credits( get_self(), get_self().value );
+         auto credit = credits.find( creator.value );
+         if( credit != credits.end() ) {
+            core = credit->core_symbol;
+            if( credit->accounts > 1 ) {
+               credits.modify( credit, same_payer, [&]( auto& c ) {
+                  --c.accounts;
+               });
+            } else {
+               credits.erase( credit );
+            }
+         } else {
+            const auto& account_creation_fee = _state.get().global2.account_creation_fee;
+            check( account_creation_fee.amount > 0, "account_creation_fee must set first" );
+            transfer_action_type action_data{ creator, saving_account, account_creation_fee, "new account creation fee" };
+            eosio::action( permission_level{ creator, "active"_n }, token_account, "transfer"_n, action_data ).send();
+         }
       }
 
       user_resources_table  userres( get_self(), newact.value );
 
+      const asset zero_asset( 0, core ? *core : core_symbol() );
       userres.emplace( newact, [&]( auto& res ) {
         res.owner = newact;
-        res.net_weight = asset( 0, system_contract::get_core_symbol() );
-        res.cpu_weight = asset( 0, system_contract::get_core_symbol() );
+        res.net_weight = zero_asset;
+        res.cpu_weight = zero_asset;
+        res.self_cpu_weight.emplace( zero_asset );
       });
 
       set_resource_limits( newact, 0, 0, 0 );
    }
 
+   /**
+    *  Creates every account of `accounts` with an inline `newaccount` authorized by `creator`.
+    *  The creation fee of the whole batch is charged with a single transfer, the accounts are
+    *  then created against the credit recorded in `acntcredit` instead of paying one by one.
+    */
+   void system_contract::newaccounts( const name& creator, const std::vector<new_account_spec>& accounts ) {
+      require_auth( creator );
+      check( !accounts.empty(), "no accounts to create" );
+
+      if( creator != get_self() ) {
+         const auto& account_creation_fee = _state.get().global2.account_creation_fee;
+         check( account_creation_fee.amount > 0, "account_creation_fee must set first" );
+         transfer_action_type action_data{ creator, saving_account, account_creation_fee * static_cast<int64_t>( accounts.size() ),
+                                           "new account creation fee" };
+         eosio::action( permission_level{ creator, "active"_n }, token_account, "transfer"_n, action_data ).send();
+
+         account_credit_table credits( get_self(), get_self().value );
+         auto credit = credits.find( creator.value );
+         if( credit == credits.end() ) {
+            credits.emplace( creator, [&]( auto& c ) {
+               c.creator     = creator;
+               c.accounts    = accounts.size();
+               c.core_symbol = core_symbol();
+            });
+         } else {
+            credits.modify( credit, same_payer, [&]( auto& c ) {
+               c.accounts += accounts.size();
+            });
+         }
+      }
+
+      for( const auto& spec : accounts ) {
+         eosio::action( permission_level{ creator, "active"_n }, get_self(), "newaccount"_n,
+                        std::make_tuple( creator, spec.account, spec.owner, spec.active ) ).send();
+      }
+   }
+
    void native::setabi( const name& acnt, const std::vector<char>& abi ) {
-      eosio::multi_index< "abihash"_n, abi_hash >  table(get_self(), get_self().value);
+      abi_hash_table table(get_self(), get_self().value);
       auto itr = table.find( acnt.value );
       if( itr == table.end() ) {
          table.emplace( acnt, [&]( auto& row ) {
@@ -176,26 +300,47 @@ namespace eosiosystem {
       check( system_token_supply.symbol == core, "specified core symbol does not exist (precision mismatch)" );
       check( system_token_supply.amount > 0, "system token supply must be greater than 0" );
 
-      _gstate2.core_symbol = core;
+      _state.modify().global2.core_symbol = core;
    }
 
    void system_contract::setvweight( uint32_t company_weight, uint32_t government_weight ){
       require_auth( _self );
       check( 100 <= company_weight && company_weight <= 1000, "company_weight range is [100,1000]" );
       check( 100 <= government_weight && government_weight <= 1000, "company_weight range is [100,1000]" );
-      _vwstate.company_weight = company_weight;
-      _vwstate.government_weight = government_weight;
+      const auto& current = _state.get().vote_weight;
+      if( current.company_weight == company_weight && current.government_weight == government_weight ) {
+         return;
+      }
+      auto& vwstate = _state.modify().vote_weight;
+      vwstate.company_weight = company_weight;
+      vwstate.government_weight = government_weight;
+
+      // restart the recalculation of every producer's total_vote_weight, see recalcvotes
+      set_cursor( "recalcvotes"_n, 0 );
    }
 
    void system_contract::setacntfee( asset account_creation_fee ){
       require_auth( _self );
       check( core_symbol() == account_creation_fee.symbol, "token symbol not match" );
       check( 0 < account_creation_fee.amount && account_creation_fee.amount <= 10 * std::pow(10,core_symbol().precision()), (string("fee range is {0, 10.0 ") + core_symbol().code().to_string() + "]" ).c_str() );
-      _gstate2.account_creation_fee = account_creation_fee;
+      _state.modify().global2.account_creation_fee = account_creation_fee;
    }
 
    void system_contract::setacntype( name acnt, name type ){
       require_auth( admin_account );
+      set_account_type( acnt, type );
+   }
+
+   void system_contract::setacntypes( const std::vector<std::pair<name, name>>& types ){
+      require_auth( admin_account );
+      check( !types.empty(), "no account types to set" );
+
+      for( const auto& [acnt, type] : types ) {
+         set_account_type( acnt, type );
+      }
+   }
+
+   void system_contract::set_account_type( const name& acnt, const name& type ){
       check( is_account( acnt ), "account not exist");
 
       auto itr = _acntype.find( acnt.value );
@@ -207,22 +352,62 @@ namespace eosiosystem {
          r.account = acnt;
          r.type = type ;
       });
+
+      auto voter_itr = _voters.find( acnt.value );
+      if( voter_itr != _voters.end() ) {
+         _voters.modify( voter_itr, same_payer, [&]( auto& v ) {
+            v.set_account_type( type );
+         });
+      }
+   }
+
+   /**
+    *  Stamps the registered account type into the `voters` rows of accounts typed before
+    *  voter_info cached it, walking `acntype` in batches of at most `max_rows` rows.
+    */
+   void system_contract::syncacntype( uint32_t max_rows ) {
+      check( has_auth(admin_account) || has_auth(_self), "must have auth of admin or eosio");
+      check( 0 < max_rows, "max_rows must be positive" );
+
+      static constexpr name job = "syncacntype"_n;
+      auto itr = _acntype.lower_bound( get_cursor( job ).value_or( 0 ) );
+      for( ; itr != _acntype.end() && 0 < max_rows; ++itr, --max_rows ) {
+         auto voter_itr = _voters.find( itr->account.value );
+         if( voter_itr != _voters.end() && voter_itr->account_type() != itr->type ) {
+            _voters.modify( voter_itr, same_payer, [&]( auto& v ) {
+               v.set_account_type( itr->type );
+            });
+         }
+      }
+
+      set_cursor( job, itr == _acntype.end() ? std::optional<uint64_t>() : itr->account.value );
    }
 
    void system_contract::awlset( string action, name account ){
       check( has_auth(admin_account) || has_auth(_self), "must have auth of admin or eosio");
       check( action == "add" || action == "delete" ,"action must be one of [add, delete]");
 
-      if (action == "add"  ){
-         auto itr = _cwl.find( account.value );
+      update_white_list( action == "add" ? cwl_operation::add : cwl_operation::remove, account );
+   }
+
+   void system_contract::awlsetmany( uint8_t op, const std::vector<name>& accounts ){
+      check( has_auth(admin_account) || has_auth(_self), "must have auth of admin or eosio");
+      check( op <= static_cast<uint8_t>( cwl_operation::remove ), "op must be one of [0 (add), 1 (remove)]");
+      check( !accounts.empty(), "no accounts to update" );
+
+      for( const auto& account : accounts ) {
+         update_white_list( static_cast<cwl_operation>( op ), account );
+      }
+   }
+
+   void system_contract::update_white_list( cwl_operation op, const name& account ){
+      auto itr = _cwl.find( account.value );
+      if ( op == cwl_operation::add ){
          check(itr == _cwl.end(), "account already exist");
          _cwl.emplace( _self, [&]( auto& r ) {
               r.account = account;
          });
-      }
-
-      if (action == "delete"  ){
-         auto itr = _cwl.find( account.value );
+      } else {
          check(itr != _cwl.end(), "account not exist");
          _cwl.erase( itr );
       }
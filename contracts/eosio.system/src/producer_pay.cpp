@@ -17,7 +17,10 @@ namespace eosiosystem {
       _ds >> timestamp >> producer;
 
       /// only update block producers once every minute, block_timestamp is in half seconds
-      if( timestamp.slot - _gstate.last_producer_schedule_update.slot > 120 ) {
+      if( timestamp.slot - _state.get().global.last_producer_schedule_update.slot > 120 ) {
+         recalc_vote_weights( onblock_recalc_rows );
+         fold_proxy_weights( onblock_proxy_rows );
+         fold_vote_deltas( onblock_fold_rows );
          update_elected_producers( timestamp );
       }
    }
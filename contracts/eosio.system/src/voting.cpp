@@ -11,6 +11,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <map>
 
 namespace eosiosystem {
 
@@ -37,6 +38,12 @@ namespace eosiosystem {
             if ( info.last_claim_time == time_point() )
                info.last_claim_time = ct;
          });
+
+         if ( !get_tally( producer, producer ).active() ) {
+            _tallies.modify( producer.value, [&]( producer_tally& t ){
+               t.is_active = true;
+            });
+         }
       } else {
          _producers.emplace( producer, [&]( producer_info& info ){
             info.owner           = producer;
@@ -47,8 +54,13 @@ namespace eosiosystem {
             info.location        = location;
             info.last_claim_time = ct;
          });
+         _prodtally.emplace( producer, [&]( producer_tally& t ){
+            t.owner     = producer;
+            t.is_active = true;
+         });
       }
 
+      invalidate_elected( producer );
    }
 
    void system_contract::unregprod( const name producer ) {
@@ -58,32 +70,142 @@ namespace eosiosystem {
       _producers.modify( prod, same_payer, [&]( producer_info& info ){
          info.deactivate();
       });
+      get_tally( producer, producer );
+      _tallies.modify( producer.value, [&]( producer_tally& t ){
+         t.is_active = false;
+      });
+      invalidate_elected( producer );
+   }
+
+   /**
+    *  Producers registered before `prodtally` existed keep their vote counters in `producer_info`
+    *  until their tally row is created here, which also zeroes the counters left in `producer_info`.
+    *  The ranking only sees producers that have a tally row, so every producer is migrated in one
+    *  call, in the same transaction that upgrades the contract. It is not batched: a partial migration
+    *  would let the ranking propose a schedule without the producers that are not migrated yet.
+    */
+   void system_contract::migrateprods() {
+      require_auth( get_self() );
+
+      for ( auto it = _producers.cbegin(); it != _producers.cend(); ++it ) {
+         if ( _prodtally.find( it->owner.value ) == _prodtally.end() ) {
+            get_tally( it->owner, get_self() );
+         }
+      }
+   }
+
+   const producer_tally& system_contract::get_tally( const name& producer, const name& payer ) {
+      if ( const auto* tally = _tallies.find( producer.value ) ) {
+         return *tally;
+      }
+
+      const auto& prod = _producers.get( producer.value, "producer not found" );
+      _prodtally.emplace( payer, [&]( producer_tally& t ){
+         t.owner             = prod.owner;
+         t.company_votes     = prod.company_votes;
+         t.government_votes  = prod.government_votes;
+         t.is_active         = prod.is_active;
+         t.update_weight( _state.get().vote_weight );
+      });
+      // the counters now live in `prodtally`, zero the frozen copy so `producers` does not show stale votes
+      if ( prod.total_vote_weight != 0 || prod.company_votes != 0 || prod.government_votes != 0 ) {
+         _producers.modify( prod, same_payer, [&]( producer_info& info ){
+            info.total_vote_weight = 0;
+            info.company_votes     = 0;
+            info.government_votes  = 0;
+         });
+      }
+      return _tallies.get( producer.value );
    }
 
    void system_contract::update_elected_producers( const block_timestamp& block_time ) {
-      _gstate.last_producer_schedule_update = block_time;
+      auto& gstate = _state.modify().global;
+      gstate.last_producer_schedule_update = block_time;
+
+      ranking_change_table changes( get_self(), get_self().value );
+      if ( !_elected.get().stale && changes.begin() == changes.end() ) {
+         return;
+      }
 
-      auto idx = _producers.get_index<"prototalvote"_n>();
+      _tallies.flush();
+      auto idx = _prodtally.get_index<"prototalvote"_n>();
+      // active producers with a positive weight, the only candidates
+      const auto candidates_end = idx.upper_bound( producer_tally::ranking_key( true, 1 ) );
 
       std::vector< eosio::producer_key > top_producers;
       top_producers.reserve(21);
 
-      for ( auto it = idx.cbegin(); it != idx.cend() && top_producers.size() < 21 && 0 < it->total_vote_weight && it->active(); ++it ) {
-         top_producers.emplace_back( eosio::producer_key{it->owner, it->producer_key} );
+      uint128_t min_vote_weight = 0;
+      auto it = idx.cbegin();
+      for ( ; it != candidates_end && top_producers.size() < 21; ++it ) {
+         const auto& prod = _producers.get( it->owner.value, "producer not found" );
+         top_producers.emplace_back( eosio::producer_key{it->owner, prod.producer_key} );
+         min_vote_weight = it->total_vote_weight;
+      }
+
+      auto& elected = _elected.modify();
+      elected.min_vote_weight       = top_producers.size() < 21 ? 0 : min_vote_weight;
+      elected.runner_up_vote_weight = ( it != candidates_end ) ? it->total_vote_weight : 0;
+
+      // order by name so that a reordering of the same members keeps the same schedule
+      std::sort( top_producers.begin(), top_producers.end(), []( const eosio::producer_key& a, const eosio::producer_key& b ) {
+         return a.producer_name < b.producer_name;
+      });
+      elected.producers.clear();
+      for( const auto& item : top_producers )
+         elected.producers.push_back( item.producer_name );
+
+      // The change is handled once the set is proposed or equals the last proposed schedule. Otherwise (a proposal
+      // is already in flight, or the set is smaller than the current schedule) `stale` and `rankchange` stay set
+      // so that the next schedule update scans and proposes again.
+      bool handled = false;
+      if ( !top_producers.empty() && gstate.last_producer_schedule_size <= top_producers.size() ) {
+         const auto packed_schedule = eosio::pack( top_producers );
+         const auto schedule_hash   = eosio::sha256( packed_schedule.data(), packed_schedule.size() );
+         if ( schedule_hash == elected.schedule_hash ) {
+            handled = true;
+         } else if ( set_proposed_producers( top_producers ) >= 0 ) {
+            gstate.last_producer_schedule_size = static_cast<decltype(gstate.last_producer_schedule_size)>( top_producers.size() );
+            elected.schedule_hash = schedule_hash;
+            handled = true;
+         }
       }
 
-      if ( top_producers.empty() || top_producers.size() < _gstate.last_producer_schedule_size ) {
+      elected.stale = !handled;
+      if ( handled ) {
+         for ( auto itr = changes.begin(); itr != changes.end(); ) {
+            itr = changes.erase( itr );
+         }
+      }
+   }
+
+   /**
+    *  Records a ranking change if the weight change of `tally` may move it in or out of the elected set:
+    *  a member dropping to or below the best outsider or below the recorded minimum, or an outsider
+    *  reaching the minimum. Other changes keep the set and write nothing.
+    */
+   void system_contract::note_vote_change( const producer_tally& tally, uint128_t old_weight ) {
+      const auto& elected = _elected.get();
+      if ( elected.stale || !tally.active() ) {
          return;
       }
 
-      std::vector<eosio::producer_key> producers;
+      const uint128_t new_weight = tally.total_vote_weight;
+      const bool may_change = elected.is_member( tally.owner )
+         ? new_weight < old_weight && ( new_weight <= elected.runner_up_vote_weight || new_weight < elected.min_vote_weight )
+         : old_weight < new_weight && elected.min_vote_weight <= new_weight;
 
-      producers.reserve(top_producers.size());
-      for( const auto& item : top_producers )
-         producers.push_back(item);
+      if ( may_change ) {
+         invalidate_elected( tally.owner );
+      }
+   }
 
-      if( set_proposed_producers( producers ) >= 0 ) {
-         _gstate.last_producer_schedule_size = static_cast<decltype(_gstate.last_producer_schedule_size)>( top_producers.size() );
+   void system_contract::invalidate_elected( const name& producer ) {
+      ranking_change_table changes( get_self(), get_self().value );
+      if ( changes.find( producer.value ) == changes.end() ) {
+         changes.emplace( get_self(), [&]( auto& c ) {
+            c.producer = producer;
+         });
       }
    }
 
@@ -93,65 +215,319 @@ namespace eosiosystem {
       for( size_t i = 1; i < producers.size(); ++i ) {
          check( producers[i-1] < producers[i], "producer votes must be unique and sorted" );
       }
+      if ( proxy ) {
+         check( producers.size() == 0, "cannot vote for producers and proxy at same time" );
+         check( voter_name != proxy, "cannot proxy to self" );
+      }
 
       auto voter_itr = _voters.find( voter_name.value );
       check( voter_itr != _voters.end(), "user must stake before they can vote" );
 
-      auto itr = _acntype.find( voter_name.value );
-      check( itr != _acntype.end(), "user must registered as company or government");
+      auto a_type = voter_account_type( *voter_itr );
+      check( a_type != name(), "user must registered as company or government");
+
+      if ( proxy ) {
+         check( !voter_itr->is_proxy, "account registered as a proxy is not allowed to use a proxy" );
+         const auto& new_proxy = _voters.get( proxy.value, "invalid proxy specified" );
+         check( new_proxy.is_proxy, "proxy not found" );
+         check( voter_account_type( new_proxy ) == a_type, "proxy must have the same account type as the voter" );
+      }
 
       auto old_producers = voter_itr->producers;
-      auto old_staked    = voter_itr->staked;
-      auto new_producers = producers;
-      auto new_staked    = voter_itr->staked;
-      auto a_type        = itr->type;
+      auto old_proxy     = voter_itr->proxy;
+      auto old_staked    = voter_itr->applied_vote_weight();
 
       _voters.modify( voter_itr, same_payer, [&]( auto& v ) {
-         v.producers = new_producers;
+         v.proxy     = proxy;
+         v.producers = producers;
+         v.set_account_type( a_type );
+         if ( v.is_proxy ) {
+            v.last_vote_weight = v.vote_weight();
+         }
       });
 
-      update_producers_votes( a_type, true, old_producers, old_staked, new_producers, new_staked );
+      if ( old_proxy != proxy ) {
+         if ( old_proxy ) {
+            add_proxied_weight( old_proxy, -voter_itr->staked );
+         }
+         if ( proxy ) {
+            add_proxied_weight( proxy, voter_itr->staked );
+         }
+      }
+
+      update_producers_votes( voter_name, a_type, true, old_producers, old_staked, voter_itr->producers, voter_itr->applied_vote_weight() );
    }
 
-   void system_contract::update_producers_votes( name a_type, bool voting,
-                                                 const std::vector<name>& old_producers, int64_t old_staked,
-                                                 const std::vector<name>& new_producers, int64_t new_staked ) {
-      if( old_staked != 0){
-          for( const auto& p : old_producers  ) {
-             auto pitr = _producers.find( p.value );
-             check( !voting || pitr->active(), "producer is not currently registered" );
-             if ( a_type == name_company ){
-                _producers.modify( pitr, same_payer, [&]( auto& p ) {
-                   p.company_votes -= old_staked;
-                });
-             } else {
-               _producers.modify( pitr, same_payer, [&]( auto& p ) {
-                   p.government_votes -= old_staked;
-               });
-             }
-            _producers.modify( pitr, same_payer, [&]( auto& p ) {
-               p.total_vote_weight = p.government_votes * _vwstate.government_weight + p.company_votes * _vwstate.company_weight;
+   /**
+    *  Registers `proxy` as a proxy that other voters of the same account type can delegate their vote to,
+    *  or unregisters it. Delegators of an unregistered proxy keep pointing to it but no longer count.
+    */
+   void system_contract::regproxy( const name& proxy, bool isproxy ) {
+      require_auth( proxy );
+
+      auto pitr = _voters.find( proxy.value );
+      if ( pitr == _voters.end() ) {
+         check( isproxy, "proxy not found" );
+         const auto type_itr = _acntype.find( proxy.value );
+         check( type_itr != _acntype.end(), "proxy must registered as company or government" );
+         _voters.emplace( proxy, [&]( auto& v ) {
+            v.owner    = proxy;
+            v.is_proxy = true;
+            v.set_account_type( type_itr->type );
+         });
+         return;
+      }
+
+      check( isproxy != pitr->is_proxy, "action has no effect" );
+      check( !isproxy || !pitr->proxy, "account that uses a proxy is not allowed to become a proxy" );
+      const auto a_type = voter_account_type( *pitr );
+      check( a_type != name(), "proxy must registered as company or government" );
+
+      const int64_t old_weight = pitr->applied_vote_weight();
+      _voters.modify( pitr, same_payer, [&]( auto& v ) {
+         v.is_proxy         = isproxy;
+         v.last_vote_weight = isproxy ? v.vote_weight() : 0;
+         v.set_account_type( a_type );
+      });
+
+      if ( pitr->producers.size() ) {
+         update_producers_votes( proxy, a_type, false, pitr->producers, old_weight, pitr->producers, pitr->applied_vote_weight() );
+      }
+   }
+
+   /**
+    *  Adds `delta` to the weight delegated to `proxy`. Its producers are not touched here, the proxy is
+    *  queued in `dirtyproxy` and its net change is applied once by `fold_proxy_weights`.
+    */
+   void system_contract::add_proxied_weight( const name& proxy, int64_t delta ) {
+      if ( delta == 0 ) {
+         return;
+      }
+
+      auto pitr = _voters.find( proxy.value );
+      check( pitr != _voters.end(), "proxy not found" );
+      _voters.modify( pitr, same_payer, [&]( auto& v ) {
+         v.proxied_vote_weight += delta;
+      });
+      check( 0 <= pitr->proxied_vote_weight, "proxied vote weight cannot be negative" );
+
+      if ( pitr->is_proxy && pitr->producers.size() ) {
+         dirty_proxy_table dirty( get_self(), get_self().value );
+         if ( dirty.find( proxy.value ) == dirty.end() ) {
+            dirty.emplace( get_self(), [&]( auto& d ) {
+               d.proxy = proxy;
+            });
+         }
+      }
+   }
+
+   /**
+    *  Applies the proxied weight change of at most `max_rows` queued proxies to their producers.
+    *  Returns false if no proxy is queued.
+    */
+   bool system_contract::fold_proxy_weights( uint32_t max_rows ) {
+      dirty_proxy_table dirty( get_self(), get_self().value );
+      auto itr = dirty.begin();
+      if ( itr == dirty.end() ) {
+         return false;
+      }
+
+      for ( ; itr != dirty.end() && 0 < max_rows; --max_rows ) {
+         const auto& proxy = _voters.get( itr->proxy.value, "proxy not found" );
+         const int64_t old_weight = proxy.applied_vote_weight();
+         const int64_t new_weight = proxy.vote_weight();
+         const auto    a_type     = proxy.account_type();
+         if ( proxy.is_proxy && old_weight != new_weight ) {
+            _voters.modify( proxy, same_payer, [&]( auto& v ) {
+               v.last_vote_weight = new_weight;
+            });
+            if ( proxy.producers.size() && a_type != name() ) {
+               update_producers_votes( proxy.owner, a_type, false, proxy.producers, old_weight, proxy.producers, new_weight );
+            }
+         }
+         itr = dirty.erase( itr );
+      }
+      return true;
+   }
+
+   /**
+    *  Recomputes total_vote_weight of at most `max_rows` producers with the vote weights set by
+    *  `setvweight`, resuming from the `recalcvotes` cursor. Returns false if no recalculation is pending.
+    */
+   bool system_contract::recalc_vote_weights( uint32_t max_rows ) {
+      static constexpr name job = "recalcvotes"_n;
+      const auto cursor = get_cursor( job );
+      if ( !cursor ) {
+         return false;
+      }
+
+      const auto& vwstate = _state.get().vote_weight;
+      _tallies.flush();
+      auto itr = _prodtally.lower_bound( *cursor );
+      for ( ; itr != _prodtally.end() && 0 < max_rows; ++itr, --max_rows ) {
+         auto tally = *itr;
+         tally.update_weight( vwstate );
+         if ( itr->total_vote_weight != tally.total_vote_weight ) {
+            _tallies.modify( itr->owner.value, [&]( auto& p ) {
+               p.total_vote_weight = tally.total_vote_weight;
             });
-          }
-      }
-
-      if ( new_staked != 0 ){
-          for( const auto& p : new_producers  ) {
-               auto pitr = _producers.find( p.value );
-               check( !voting || pitr->active(), "producer is not currently registered" );
-               if ( a_type == name_company ){
-                  _producers.modify( pitr, same_payer, [&]( auto& p ) {
-                     p.company_votes += new_staked;
-                  });
-               } else {
-                 _producers.modify( pitr, same_payer, [&]( auto& p ) {
-                     p.government_votes += new_staked;
-                 });
+            invalidate_elected( itr->owner );
+         }
+      }
+
+      set_cursor( job, itr == _prodtally.end() ? std::optional<uint64_t>() : itr->owner.value );
+      return true;
+   }
+
+   void system_contract::recalcvotes( uint32_t max_rows ) {
+      check( 0 < max_rows, "max_rows must be positive" );
+      check( recalc_vote_weights( max_rows ), "no vote weight recalculation pending" );
+   }
+
+   void system_contract::setlazyvotes( bool enabled ) {
+      require_auth( get_self() );
+      _state.modify().lazy_votes.emplace( enabled );
+   }
+
+   /**
+    *  Applies the queued vote deltas of at most `max_rows` voters with a single tally write per producer.
+    *  The queue is keyed by voter, so it is walked in voter name order from the `foldvotes` cursor, wrapping
+    *  around at the end: voters queued behind a busy range of names are still reached. Returns false if
+    *  no delta is queued.
+    */
+   bool system_contract::fold_vote_deltas( uint32_t max_rows ) {
+      if ( _votedelta.begin() == _votedelta.end() ) {
+         return false;
+      }
+
+      static constexpr name job = "foldvotes"_n;
+      auto itr = _votedelta.lower_bound( get_cursor( job ).value_or( 0 ) );
+      std::map< name, std::pair<int64_t, int64_t> > net_deltas;
+      for ( ; 0 < max_rows; --max_rows ) {
+         if ( itr == _votedelta.end() ) {
+            itr = _votedelta.begin();
+            if ( itr == _votedelta.end() ) {
+               break;
+            }
+         }
+         for ( const auto& d : itr->deltas ) {
+            auto& net = net_deltas[d.producer];
+            net.first  += d.company_votes;
+            net.second += d.government_votes;
+         }
+         itr = _votedelta.erase( itr );
+      }
+      set_cursor( job, itr == _votedelta.end() ? std::optional<uint64_t>() : itr->voter.value );
+
+      for ( const auto& [producer, net] : net_deltas ) {
+         if ( net.first != 0 || net.second != 0 ) {
+            apply_vote_delta( producer, net.first, net.second );
+         }
+      }
+      return true;
+   }
+
+   /**
+    *  Adds `deltas`, sorted by producer, to the queued vote changes of `voter`.
+    */
+   void system_contract::queue_vote_deltas( const name& voter, const std::vector<vote_delta>& deltas ) {
+      auto itr = _votedelta.find( voter.value );
+      if ( itr == _votedelta.end() ) {
+         _votedelta.emplace( get_self(), [&]( auto& p ) {
+            p.voter  = voter;
+            p.deltas = deltas;
+         });
+         return;
+      }
+
+      _votedelta.modify( itr, same_payer, [&]( auto& p ) {
+         std::vector<vote_delta> merged;
+         merged.reserve( p.deltas.size() + deltas.size() );
+         auto queued_itr = p.deltas.begin();
+         auto added_itr  = deltas.begin();
+         while ( queued_itr != p.deltas.end() || added_itr != deltas.end() ) {
+            if ( added_itr == deltas.end() || ( queued_itr != p.deltas.end() && queued_itr->producer < added_itr->producer ) ) {
+               merged.push_back( *queued_itr++ );
+            } else if ( queued_itr == p.deltas.end() || added_itr->producer < queued_itr->producer ) {
+               merged.push_back( *added_itr++ );
+            } else {
+               vote_delta sum = *queued_itr++;
+               sum.company_votes    += added_itr->company_votes;
+               sum.government_votes += added_itr->government_votes;
+               ++added_itr;
+               if ( sum.company_votes != 0 || sum.government_votes != 0 ) {
+                  merged.push_back( sum );
                }
-               _producers.modify( pitr, same_payer, [&]( auto& p ) {
-                  p.total_vote_weight = p.government_votes * _vwstate.government_weight + p.company_votes * _vwstate.company_weight;
-               });
-          }
+            }
+         }
+         p.deltas = std::move( merged );
+      });
+   }
+
+   void system_contract::foldvotes( uint32_t max_rows ) {
+      check( 0 < max_rows, "max_rows must be positive" );
+      const bool proxies = fold_proxy_weights( max_rows );
+      const bool deltas  = fold_vote_deltas( max_rows );
+      check( proxies || deltas, "no pending vote changes" );
+   }
+
+   void system_contract::apply_vote_delta( const name& producer, int64_t company_delta, int64_t government_delta ) {
+      const auto& vwstate = _state.get().vote_weight;
+      const uint128_t old_weight = get_tally( producer, get_self() ).total_vote_weight;
+      const auto& tally = _tallies.modify( producer.value, [&]( auto& p ) {
+         p.company_votes    += company_delta;
+         p.government_votes += government_delta;
+         p.update_weight( vwstate );
+      });
+      note_vote_change( tally, old_weight );
+   }
+
+   void system_contract::update_producers_votes( const name& voter, name a_type, bool voting,
+                                                 const std::vector<name>& old_producers, int64_t old_staked,
+                                                 const std::vector<name>& new_producers, int64_t new_staked ) {
+      const bool lazy_votes = _state.get().lazy();
+      std::vector<vote_delta> queued;
+
+      // both lists are sorted (voteproducer enforces it), so a single merge pass yields one net delta per producer
+      auto old_itr = old_producers.begin();
+      auto new_itr = new_producers.begin();
+      while( old_itr != old_producers.end() || new_itr != new_producers.end() ) {
+         name    producer;
+         int64_t delta    = 0;
+         bool    is_added = false;
+
+         if( new_itr == new_producers.end() || ( old_itr != old_producers.end() && *old_itr < *new_itr ) ) {
+            producer = *old_itr++;
+            delta    = -old_staked;
+         } else if( old_itr == old_producers.end() || *new_itr < *old_itr ) {
+            producer = *new_itr++;
+            delta    = new_staked;
+            is_added = true;
+         } else {
+            producer = *new_itr++;
+            delta    = new_staked - old_staked;
+            ++old_itr;
+         }
+
+         if( delta == 0 ) {
+            continue;
+         }
+
+         if( voting && is_added ) {
+            check( get_tally( producer, get_self() ).active(), "producer is not currently registered" );
+         }
+
+         const int64_t company_delta    = a_type == name_company ? delta : 0;
+         const int64_t government_delta = a_type == name_company ? 0 : delta;
+         if( lazy_votes ) {
+            queued.push_back( vote_delta{ producer, company_delta, government_delta } );
+         } else {
+            apply_vote_delta( producer, company_delta, government_delta );
+         }
+      }
+
+      if( !queued.empty() ) {
+         queue_vote_deltas( voter, queued );
       }
    }
 } /// namespace eosiosystem
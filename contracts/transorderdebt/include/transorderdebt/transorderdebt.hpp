@@ -1,6 +1,11 @@
  #include <eosio/eosio.hpp>
  #include <eosio/system.hpp>
  #include <eosio/asset.hpp>
+ #include <eosio/singleton.hpp>
+
+ #include <map>
+ #include <optional>
+ #include <set>
 
 using namespace eosio;
 
@@ -9,38 +14,101 @@ namespace eosio{
     public:
       using contract::contract;
 
+      struct trans_data{
+        checksum256 trans_id;
+        name from;
+        name to;
+        asset quantity;
+        std::string memo;
+        asset fee;
+      };
+
+      struct order_data{
+        uint128_t order_id;
+        name account;
+        std::string logistics;
+        std::string goods_info;
+        name merchant;
+      };
+
+      struct debt_data{
+        uint128_t debt_id;
+        name debtor;
+        name creditor;
+        asset quantity;
+        asset fee;
+        std::map<std::string, std::string> profile;
+      };
+
       [[eosio::action]]
       void transupsert(checksum256 trans_id, name from, name to, asset quantity, std::string memo, asset fee);
 
+      [[eosio::action]]
+      void transupsertb(const std::vector<trans_data>& records);
+
       [[eosio::action]]
       void transerase(checksum256 trans_id);
 
       [[eosio::action]]
       void orderupsert(uint128_t order_id, name account, std::string logistics, std::string goods_info, name merchant);
 
+      [[eosio::action]]
+      void orderupsertb(const std::vector<order_data>& records);
+
+      [[eosio::action]]
+      void orderpatch(uint128_t order_id, std::optional<name> account, std::optional<std::string> logistics,
+                      std::optional<std::string> goods_info, std::optional<name> merchant);
+
       [[eosio::action]]
       void ordererase(uint128_t order_id);
 
       [[eosio::action]]
       void debtupsert(uint128_t debt_id, name debtor, name creditor, asset quantity, asset fee, std::map<std::string, std::string> profile);
 
+      [[eosio::action]]
+      void debtupsertb(const std::vector<debt_data>& records);
+
+      [[eosio::action]]
+      void debtpatch(uint128_t debt_id, std::optional<name> debtor, std::optional<name> creditor, std::optional<asset> quantity,
+                     std::optional<asset> fee, std::optional<std::map<std::string, std::string>> profile);
+
       [[eosio::action]]
       void debterase(uint128_t debt_id);
 
+      [[eosio::action]]
+      void migraterecs(name table, uint32_t max_rows);
+
+      [[eosio::action]]
+      void prune(name table, uint32_t before_bucket, uint32_t max_rows);
+
 
 
       using trans_upsert_action = eosio::action_wrapper<"transupsert"_n, &transorderdebt::transupsert>;
 
+      using trans_upsert_batch_action = eosio::action_wrapper<"transupsertb"_n, &transorderdebt::transupsertb>;
+
       using trans_erase_aciton = eosio::action_wrapper<"transerase"_n, &transorderdebt::transerase>;
 
       using order_upsert_action = eosio::action_wrapper<"orderupsert"_n, &transorderdebt::orderupsert>;
 
+      using order_upsert_batch_action = eosio::action_wrapper<"orderupsertb"_n, &transorderdebt::orderupsertb>;
+
+      using order_patch_action = eosio::action_wrapper<"orderpatch"_n, &transorderdebt::orderpatch>;
+
       using order_erase_action = eosio::action_wrapper<"ordererase"_n, &transorderdebt::ordererase>;
 
       using debt_upsert_action = eosio::action_wrapper<"debtupsert"_n, &transorderdebt::debtupsert>;
 
+      using debt_upsert_batch_action = eosio::action_wrapper<"debtupsertb"_n, &transorderdebt::debtupsertb>;
+
+      using debt_patch_action = eosio::action_wrapper<"debtpatch"_n, &transorderdebt::debtpatch>;
+
       using debt_erase_aciton = eosio::action_wrapper<"debterase"_n, &transorderdebt::debterase>;
 
+      using migrate_records_action = eosio::action_wrapper<"migraterecs"_n, &transorderdebt::migraterecs>;
+
+      using prune_action = eosio::action_wrapper<"prune"_n, &transorderdebt::prune>;
+
     private:
 
       struct [[eosio::table]] transrecord{
@@ -92,5 +160,156 @@ namespace eosio{
 
       using debt_index = eosio::multi_index<"debts"_n, debt, indexed_by<"bydebtid"_n, const_mem_fun<debt,
       uint128_t, &debt::get_secondary_1>>>;
+
+      // The tables above are legacy: rows are written to the direct-keyed tables below, whose primary key is
+      // derived from the business id by `key_of`. Ids whose keys collide take the next free key (linear probing).
+      // Legacy rows are moved over when they are upserted or by `migraterecs`, lookups fall back to them until then.
+      //
+      // Records are scoped by the day bucket (days since epoch) of their creation, so that `prune` can drop whole
+      // days. The locator tables, scoped by the contract, give the bucket of every id and `buckets`, scoped by the
+      // record table name, lists the buckets in use.
+
+      static constexpr uint32_t seconds_per_bucket = 24 * 3600;
+
+      struct [[eosio::table]] keyed_transrecord{
+        uint64_t pkey;
+        checksum256 trans_id;
+        name from;
+        name to;
+        asset quantity;
+        std::string memo;
+        asset fee;
+        block_timestamp timestamp;
+
+        uint64_t primary_key() const { return pkey; }
+        const checksum256& business_id() const { return trans_id; }
+      };
+
+      using keyed_transrecord_index = eosio::multi_index<"transbyid"_n, keyed_transrecord>;
+
+      struct [[eosio::table]] keyed_order{
+        uint64_t pkey;
+        uint128_t order_id;
+        name account;
+        std::string logistics;
+        std::string goods_info;
+        name merchant;
+        block_timestamp timestamp;
+
+        uint64_t primary_key() const { return pkey; }
+        const uint128_t& business_id() const { return order_id; }
+      };
+
+      using keyed_order_index = eosio::multi_index<"ordersbyid"_n, keyed_order>;
+
+      // A debt profile attribute, `key` is the index of the attribute name in the `profilekeys` singleton.
+      struct profile_field{
+        uint16_t key;
+        std::string value;
+      };
+
+      struct [[eosio::table]] profile_keys{
+        std::vector<std::string> keys;
+      };
+
+      using profile_keys_singleton = eosio::singleton<"profilekeys"_n, profile_keys>;
+
+      struct [[eosio::table]] keyed_debt{
+        uint64_t pkey;
+        uint128_t debt_id;
+        name debtor;
+        name creditor;
+        asset quantity;
+        asset fee;
+        std::vector<profile_field> profile; // sorted by key
+        block_timestamp timestamp;
+
+        uint64_t primary_key() const { return pkey; }
+        const uint128_t& business_id() const { return debt_id; }
+      };
+
+      using keyed_debt_index = eosio::multi_index<"debtsbyid"_n, keyed_debt>;
+
+      struct [[eosio::table]] trans_locator{
+        uint64_t pkey;
+        checksum256 id;
+        uint32_t bucket;
+
+        uint64_t primary_key() const { return pkey; }
+        const checksum256& business_id() const { return id; }
+      };
+
+      using trans_locator_index = eosio::multi_index<"translocs"_n, trans_locator>;
+
+      struct [[eosio::table]] record_locator{
+        uint64_t pkey;
+        uint128_t id;
+        uint32_t bucket;
+
+        uint64_t primary_key() const { return pkey; }
+        const uint128_t& business_id() const { return id; }
+      };
+
+      using order_locator_index = eosio::multi_index<"orderlocs"_n, record_locator>;
+
+      using debt_locator_index = eosio::multi_index<"debtlocs"_n, record_locator>;
+
+      struct [[eosio::table]] bucket{
+        uint32_t day;
+
+        uint64_t primary_key() const { return day; }
+      };
+
+      using bucket_index = eosio::multi_index<"buckets"_n, bucket>;
+
+      static uint64_t key_of(uint128_t id);
+
+      static uint64_t key_of(const checksum256& id);
+
+      template<typename Table, typename Id>
+      typename Table::const_iterator find_keyed(Table& table, const Id& id, uint64_t& pkey);
+
+      template<typename Table>
+      void erase_keyed(Table& table, typename Table::const_iterator iterator);
+
+      static uint32_t bucket_of(block_timestamp timestamp);
+
+      // bucket-scoped record handles and registered buckets of this action, so a batch opens and checks each day once
+      std::map<uint32_t, keyed_transrecord_index> _trans_buckets;
+      std::map<uint32_t, keyed_order_index> _order_buckets;
+      std::map<uint32_t, keyed_debt_index> _debt_buckets;
+      std::set<std::pair<name, uint32_t>> _known_buckets;
+
+      template<typename Records>
+      std::map<uint32_t, Records>& bucket_handles();
+
+      template<typename Records>
+      Records& records_in(uint32_t day);
+
+      template<typename Records, typename Locators, typename Id>
+      uint64_t place_record(name table, Locators& locators, uint64_t locator_pkey, const Id& id, uint32_t day);
+
+      template<typename Records, typename Locators, typename Id>
+      bool erase_record(Locators& locators, const Id& id);
+
+      template<typename Records, typename Locators>
+      void prune_records(name table, uint32_t before_bucket, uint32_t max_rows);
+
+      // accounts already found to exist in this action, so a batch checks each counterparty once
+      std::set<name> _existing_accounts;
+
+      void check_account(name account, const char* msg);
+
+      void upsert_trans(trans_locator_index& locators, transrecord_index& legacy, const trans_data& data);
+
+      void upsert_order(order_locator_index& locators, order_index& legacy, const order_data& data);
+
+      // attribute names of `profilekeys`, read on the first profile encoded by this action
+      std::vector<std::string> _profile_keys;
+      bool _profile_keys_loaded = false;
+
+      std::vector<profile_field> encode_profile(const std::map<std::string, std::string>& profile);
+
+      void upsert_debt(debt_locator_index& locators, debt_index& legacy, const debt_data& data);
   };
 };
\ No newline at end of file
@@ -1,46 +1,252 @@
 #include <transorderdebt/transorderdebt.hpp>
 
+#include <algorithm>
+#include <limits>
+
 namespace eosio{
+  namespace {
+    // 64-bit finalizer of MurmurHash3, spreads every input bit over the whole key
+    uint64_t mix(uint64_t h, uint64_t v){
+      h ^= v;
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 33;
+      h *= 0xc4ceb9fe1a85ec53ULL;
+      h ^= h >> 33;
+      return h;
+    }
+  }
+
+  uint64_t transorderdebt::key_of(uint128_t id){
+    return mix(mix(0, static_cast<uint64_t>(id)), static_cast<uint64_t>(id >> 64));
+  }
+
+  uint64_t transorderdebt::key_of(const checksum256& id){
+    uint64_t key = 0;
+    for( const auto& word : id.get_array() ){
+      key = mix(mix(key, static_cast<uint64_t>(word)), static_cast<uint64_t>(word >> 64));
+    }
+    return key;
+  }
+
+  // Returns the row of `id`, or end() with `pkey` set to the free key where it is to be stored.
+  template<typename Table, typename Id>
+  typename Table::const_iterator transorderdebt::find_keyed(Table& table, const Id& id, uint64_t& pkey){
+    pkey = key_of(id);
+    for( auto iterator = table.find(pkey); iterator != table.end(); iterator = table.find(++pkey) ){
+      if( iterator->business_id() == id ){
+        return iterator;
+      }
+    }
+    return table.end();
+  }
+
+  // Erases a row and moves later rows of the probe run back into the hole, so that no lookup
+  // stops at the hole before reaching them.
+  template<typename Table>
+  void transorderdebt::erase_keyed(Table& table, typename Table::const_iterator iterator){
+    uint64_t hole = iterator->pkey;
+    table.erase(iterator);
+
+    for( uint64_t pkey = hole + 1; ; ++pkey ){
+      auto next = table.find(pkey);
+      if( next == table.end() ){
+        break;
+      }
+      // a row can fill the hole unless its own key lies between the hole and its current key
+      if( pkey - key_of(next->business_id()) >= pkey - hole ){
+        auto row = *next;
+        row.pkey = hole;
+        table.erase(next);
+        table.emplace(get_self(), [&]( auto& moved ){
+          moved = row;
+        });
+        hole = pkey;
+      }
+    }
+  }
+
+
+  template<>
+  std::map<uint32_t, transorderdebt::keyed_transrecord_index>& transorderdebt::bucket_handles<transorderdebt::keyed_transrecord_index>(){
+    return _trans_buckets;
+  }
+
+  template<>
+  std::map<uint32_t, transorderdebt::keyed_order_index>& transorderdebt::bucket_handles<transorderdebt::keyed_order_index>(){
+    return _order_buckets;
+  }
+
+  template<>
+  std::map<uint32_t, transorderdebt::keyed_debt_index>& transorderdebt::bucket_handles<transorderdebt::keyed_debt_index>(){
+    return _debt_buckets;
+  }
+
+  // Handle of the records of the bucket `day`, opened once per action so that a batch reuses its cached rows.
+  template<typename Records>
+  Records& transorderdebt::records_in(uint32_t day){
+    return bucket_handles<Records>().try_emplace(day, get_self(), day).first->second;
+  }
+
+
+  uint32_t transorderdebt::bucket_of(block_timestamp timestamp){
+    return timestamp.to_time_point().sec_since_epoch() / seconds_per_bucket;
+  }
+
+
+  // Stores the locator of `id` at the free key returned by `find_keyed` and registers `day` under `table`.
+  // Returns the free key of `id` in the records of that bucket.
+  template<typename Records, typename Locators, typename Id>
+  uint64_t transorderdebt::place_record(name table, Locators& locators, uint64_t locator_pkey, const Id& id, uint32_t day){
+    locators.emplace(get_self(), [&]( auto& row ){
+      row.pkey = locator_pkey;
+      row.id = id;
+      row.bucket = day;
+    });
+
+    if( _known_buckets.count({table, day}) == 0 ){
+      bucket_index buckets(get_self(), table.value);
+      if( buckets.find(day) == buckets.end() ){
+        buckets.emplace(get_self(), [&]( auto& row ){
+          row.day = day;
+        });
+      }
+      _known_buckets.insert({table, day});
+    }
+
+    auto& records = records_in<Records>(day);
+    uint64_t pkey = 0;
+    check( find_keyed(records, id, pkey) == records.end(), "record already exists in its bucket" );
+    return pkey;
+  }
+
+
+  template<typename Records, typename Locators, typename Id>
+  bool transorderdebt::erase_record(Locators& locators, const Id& id){
+    uint64_t pkey = 0;
+    auto locator = find_keyed(locators, id, pkey);
+    if( locator == locators.end() ){
+      return false;
+    }
+
+    auto& records = records_in<Records>(locator->bucket);
+    auto iterator = find_keyed(records, id, pkey);
+    if( iterator != records.end() ){
+      erase_keyed(records, iterator);
+    }
+    erase_keyed(locators, locator);
+    return true;
+  }
+
+
+  // Erases at most `max_rows` records of the buckets before `before_bucket`, oldest bucket first, with their locators.
+  // Rows are erased with `erase_keyed` so that the rest of a partly pruned bucket can still be found.
+  template<typename Records, typename Locators>
+  void transorderdebt::prune_records(name table, uint32_t before_bucket, uint32_t max_rows){
+    bucket_index buckets(get_self(), table.value);
+    Locators locators(get_self(), get_self().value);
+
+    for( auto day_row = buckets.begin(); day_row != buckets.end() && day_row->day < before_bucket; ){
+      auto& records = records_in<Records>(day_row->day);
+      for( auto iterator = records.begin(); iterator != records.end() && max_rows > 0; iterator = records.begin(), --max_rows ){
+        uint64_t pkey = 0;
+        auto locator = find_keyed(locators, iterator->business_id(), pkey);
+        if( locator != locators.end() ){
+          erase_keyed(locators, locator);
+        }
+        erase_keyed(records, iterator);
+      }
+
+      if( records.begin() != records.end() ){
+        break;
+      }
+      _known_buckets.erase({table, day_row->day});
+      day_row = buckets.erase(day_row);
+    }
+  }
+
+
+  void transorderdebt::check_account(name account, const char* msg){
+    if( _existing_accounts.count(account) == 0 ){
+      check( is_account( account ), msg );
+      _existing_accounts.insert(account);
+    }
+  }
+
+
   void transorderdebt::transupsert(checksum256 trans_id, name from, name to, asset quantity, std::string memo, asset fee){
     require_auth(get_self());
 
-    check( from != to, "cannot transfer to self" );
-    check( is_account( from ), "from account does not exist");
-    check( is_account( to ), "to account does not exist");
+    trans_locator_index locators(get_self(), get_self().value);
+    transrecord_index legacy(get_self(), get_self().value);
 
-    check( quantity.is_valid(), "invalid quantity" );
-    check( fee.is_valid(), "invalid quantity" );
-    check( quantity.amount > 0, "must transfer positive quantity" );
-    check( fee.amount >= 0, "must transfer positive quantity" );
-    check( quantity.symbol == fee.symbol, "symbol precision mismatch" );
-    check( memo.size() <= 256, "memo has more than 256 bytes" );
+    upsert_trans(locators, legacy, trans_data{trans_id, from, to, quantity, memo, fee});
+  }
 
-    transrecord_index transrecords(get_self(), get_self().value);
 
-    auto trans_id_index = transrecords.get_index<name("bytransid")>();
+  void transorderdebt::transupsertb(const std::vector<trans_data>& records){
+    require_auth(get_self());
+    check( !records.empty(), "no records to upsert" );
 
-    auto iterator = trans_id_index.find(trans_id);
+    trans_locator_index locators(get_self(), get_self().value);
+    transrecord_index legacy(get_self(), get_self().value);
+
+    for( const auto& data : records ){
+      upsert_trans(locators, legacy, data);
+    }
+  }
+
+
+  void transorderdebt::upsert_trans(trans_locator_index& locators, transrecord_index& legacy, const trans_data& data){
+    check( data.from != data.to, "cannot transfer to self" );
+    check_account( data.from, "from account does not exist");
+    check_account( data.to, "to account does not exist");
+
+    check( data.quantity.is_valid(), "invalid quantity" );
+    check( data.fee.is_valid(), "invalid quantity" );
+    check( data.quantity.amount > 0, "must transfer positive quantity" );
+    check( data.fee.amount >= 0, "must transfer positive quantity" );
+    check( data.quantity.symbol == data.fee.symbol, "symbol precision mismatch" );
+    check( data.memo.size() <= 256, "memo has more than 256 bytes" );
 
-    if( iterator == trans_id_index.end()){
+    uint64_t pkey = 0;
+    auto locator = find_keyed(locators, data.trans_id, pkey);
+
+    if( locator == locators.end() ){
+      if( legacy.begin() != legacy.end() ){
+        auto trans_id_index = legacy.get_index<name("bytransid")>();
+        auto legacy_iterator = trans_id_index.find(data.trans_id);
+        if( legacy_iterator != trans_id_index.end() ){
+          trans_id_index.erase(legacy_iterator);
+        }
+      }
+
+      uint32_t day = bucket_of(current_block_time());
+      pkey = place_record<keyed_transrecord_index>("transbyid"_n, locators, pkey, data.trans_id, day);
+
+      auto& transrecords = records_in<keyed_transrecord_index>(day);
       transrecords.emplace(get_self(), [&]( auto& row){
-        row.pkey = transrecords.available_primary_key();
-        row.trans_id = trans_id;
-        row.from = from;
-        row.to = to;
-        row.quantity = quantity;
-        row.memo = memo;
-        row.fee = fee;
+        row.pkey = pkey;
+        row.trans_id = data.trans_id;
+        row.from = data.from;
+        row.to = data.to;
+        row.quantity = data.quantity;
+        row.memo = data.memo;
+        row.fee = data.fee;
         row.timestamp = current_block_time();
       });
     }
     else{
-      transrecords.modify(*iterator, get_self(), [&](auto& row){
-        row.trans_id = trans_id;
-        row.from = from;
-        row.to = to;
-        row.quantity = quantity;
-        row.memo = memo;
-        row.fee = fee;
+      auto& transrecords = records_in<keyed_transrecord_index>(locator->bucket);
+      auto iterator = find_keyed(transrecords, data.trans_id, pkey);
+      check( iterator != transrecords.end(), "Transrecord does not exist in its bucket" );
+
+      transrecords.modify(iterator, get_self(), [&](auto& row){
+        row.from = data.from;
+        row.to = data.to;
+        row.quantity = data.quantity;
+        row.memo = data.memo;
+        row.fee = data.fee;
         row.timestamp = current_block_time();
       });
     }
@@ -50,9 +256,14 @@ namespace eosio{
   void transorderdebt::transerase(checksum256 trans_id){
     require_auth(get_self());
 
-    transrecord_index transrecords(get_self(), get_self().value);
+    trans_locator_index locators(get_self(), get_self().value);
+    if( erase_record<keyed_transrecord_index>(locators, trans_id) ){
+      return;
+    }
+
+    transrecord_index legacy(get_self(), get_self().value);
 
-    auto trans_id_index = transrecords.get_index<name("bytransid")>();
+    auto trans_id_index = legacy.get_index<name("bytransid")>();
 
     auto iterator = trans_id_index.find(trans_id);
 
@@ -62,109 +273,337 @@ namespace eosio{
   }
 
 
- 	void transorderdebt::orderupsert(uint128_t order_id, name account, std::string logistics, std::string goods_info, name merchant){
+  void transorderdebt::orderupsert(uint128_t order_id, name account, std::string logistics, std::string goods_info, name merchant){
+    require_auth( get_self() );
+
+    order_locator_index locators(get_self(), get_self().value);
+    order_index legacy(get_self(), get_self().value);
+
+    upsert_order(locators, legacy, order_data{order_id, account, logistics, goods_info, merchant});
+  }
+
+
+  void transorderdebt::orderupsertb(const std::vector<order_data>& records){
+    require_auth( get_self() );
+    check( !records.empty(), "no records to upsert" );
+
+    order_locator_index locators(get_self(), get_self().value);
+    order_index legacy(get_self(), get_self().value);
+
+    for( const auto& data : records ){
+      upsert_order(locators, legacy, data);
+    }
+  }
+
+
+  void transorderdebt::upsert_order(order_locator_index& locators, order_index& legacy, const order_data& data){
+    uint64_t pkey = 0;
+    auto locator = find_keyed(locators, data.order_id, pkey);
+
+    if( locator == locators.end() ){
+      if( legacy.begin() != legacy.end() ){
+        auto order_id_index = legacy.get_index<name("byorderid")>();
+        auto legacy_iterator = order_id_index.find(data.order_id);
+        if( legacy_iterator != order_id_index.end() ){
+          order_id_index.erase(legacy_iterator);
+        }
+      }
+
+      uint32_t day = bucket_of(current_block_time());
+      pkey = place_record<keyed_order_index>("ordersbyid"_n, locators, pkey, data.order_id, day);
+
+      auto& orders = records_in<keyed_order_index>(day);
+      orders.emplace(get_self(), [&]( auto& row ) {
+        row.pkey = pkey;
+        row.order_id = data.order_id;
+        row.account = data.account;
+        row.logistics = data.logistics;
+        row.goods_info = data.goods_info;
+        row.merchant = data.merchant;
+        row.timestamp = current_block_time();
+      });
+    }
+    else {
+      auto& orders = records_in<keyed_order_index>(locator->bucket);
+      auto iterator = find_keyed(orders, data.order_id, pkey);
+      check( iterator != orders.end(), "Order does not exist in its bucket" );
+
+      orders.modify(iterator, get_self(), [&]( auto& row ) {
+        row.account = data.account;
+        row.logistics = data.logistics;
+        row.goods_info = data.goods_info;
+        row.merchant = data.merchant;
+        row.timestamp = current_block_time();
+      });
+    }
+  }
+
+
+  // Updates only the given fields of an existing order, so that frequent updates such as the logistics status
+  // do not have to send the whole order.
+  void transorderdebt::orderpatch(uint128_t order_id, std::optional<name> account, std::optional<std::string> logistics,
+                                  std::optional<std::string> goods_info, std::optional<name> merchant){
+    require_auth( get_self() );
+    check( account || logistics || goods_info || merchant, "no fields to patch" );
+
+    auto patch = [&]( auto& row ) {
+      if( account ){
+        row.account = *account;
+      }
+      if( logistics ){
+        row.logistics = *logistics;
+      }
+      if( goods_info ){
+        row.goods_info = *goods_info;
+      }
+      if( merchant ){
+        row.merchant = *merchant;
+      }
+      row.timestamp = current_block_time();
+    };
+
+    order_locator_index locators(get_self(), get_self().value);
+
+    uint64_t pkey = 0;
+    auto locator = find_keyed(locators, order_id, pkey);
+    if( locator != locators.end() ){
+      auto& orders = records_in<keyed_order_index>(locator->bucket);
+      auto iterator = find_keyed(orders, order_id, pkey);
+      check( iterator != orders.end(), "Order does not exist in its bucket" );
+
+      orders.modify(iterator, get_self(), patch);
+      return;
+    }
 
- 		require_auth( get_self() );
+    order_index legacy(get_self(), get_self().value);
 
- 		order_index orders(get_self(), get_self().value);
+    auto order_id_index = legacy.get_index<name("byorderid")>();
 
- 		auto order_id_index = orders.get_index<name("byorderid")>();
+    auto iterator = order_id_index.find(order_id);
 
- 		auto iterator = order_id_index.find(order_id);
+    check(iterator != order_id_index.end(), "Order does not exist");
 
- 		if( iterator == order_id_index.end() )
-	    {
-	    	orders.emplace(get_self(), [&]( auto& row ) {
-	    		row.pkey = orders.available_primary_key();
-	    		row.order_id = order_id;
-        	row.account = account;
-        	row.logistics = logistics;
-        	row.goods_info = goods_info;
-        	row.merchant = merchant;
-        	row.timestamp = current_block_time();
-	      });
-	    }
-	    else {
-	      orders.modify(*iterator, get_self(), [&]( auto& row ) {
-	        row.order_id = order_id;
-	        row.account = account;
-	        row.logistics = logistics;
-	        row.goods_info = goods_info;
-	        row.merchant = merchant;
-	        row.timestamp = current_block_time();
-	      });
-	    }
- 	}
+    order_id_index.modify(iterator, get_self(), patch);
+  }
 
- 	void transorderdebt::ordererase(uint128_t order_id){
 
- 		require_auth( get_self() );
+  void transorderdebt::ordererase(uint128_t order_id){
+    require_auth( get_self() );
 
- 		order_index orders(get_self(), get_self().value);
+    order_locator_index locators(get_self(), get_self().value);
+    if( erase_record<keyed_order_index>(locators, order_id) ){
+      return;
+    }
 
- 		auto order_id_index = orders.get_index<name("byorderid")>();
+    order_index legacy(get_self(), get_self().value);
 
- 		auto iterator = order_id_index.find(order_id);
+    auto order_id_index = legacy.get_index<name("byorderid")>();
 
- 		check(iterator != order_id_index.end(), "Order does not exist");
+    auto iterator = order_id_index.find(order_id);
 
- 		order_id_index.erase(iterator);
- 	}
+    check(iterator != order_id_index.end(), "Order does not exist");
+
+    order_id_index.erase(iterator);
+  }
 
 
   void transorderdebt::debtupsert(uint128_t debt_id, name debtor, name creditor, asset quantity, asset fee, std::map<std::string, std::string> profile){
     require_auth(get_self());
 
-    check( debtor != creditor, "debtor and creditor cannot be same one" );
-    check( is_account( debtor ), "debtor account does not exist");
-    check( is_account( creditor ), "creditor account does not exist");
+    debt_locator_index locators(get_self(), get_self().value);
+    debt_index legacy(get_self(), get_self().value);
 
-    check( quantity.is_valid(), "invalid quantity" );
-    check( fee.is_valid(), "invalid quantity" );
-    check( quantity.amount > 0, "must transfer positive quantity" );
-    check( fee.amount >= 0, "must transfer positive quantity" );
-    check( quantity.symbol == fee.symbol, "symbol precision mismatch" );
+    upsert_debt(locators, legacy, debt_data{debt_id, debtor, creditor, quantity, fee, profile});
+  }
 
-    debt_index debts(get_self(), get_self().value);
 
-    auto debt_id_index = debts.get_index<name("bydebtid")>();
+  void transorderdebt::debtupsertb(const std::vector<debt_data>& records){
+    require_auth(get_self());
+    check( !records.empty(), "no records to upsert" );
+
+    debt_locator_index locators(get_self(), get_self().value);
+    debt_index legacy(get_self(), get_self().value);
+
+    for( const auto& data : records ){
+      upsert_debt(locators, legacy, data);
+    }
+  }
 
-    auto iterator = debt_id_index.find(debt_id);
 
-    if( iterator == debt_id_index.end()){
+  // Interns the attribute names of `profile` in `profilekeys`, appending the names not seen before.
+  std::vector<transorderdebt::profile_field> transorderdebt::encode_profile(const std::map<std::string, std::string>& profile){
+    profile_keys_singleton registry(get_self(), get_self().value);
+    if( !_profile_keys_loaded ){
+      _profile_keys = registry.get_or_default().keys;
+      _profile_keys_loaded = true;
+    }
+
+    std::vector<profile_field> fields;
+    fields.reserve(profile.size());
+    bool added = false;
+    for( const auto& [key, value] : profile ){
+      auto iterator = std::find(_profile_keys.begin(), _profile_keys.end(), key);
+      if( iterator == _profile_keys.end() ){
+        check( _profile_keys.size() <= std::numeric_limits<uint16_t>::max(), "too many profile keys" );
+        iterator = _profile_keys.insert(_profile_keys.end(), key);
+        added = true;
+      }
+      fields.push_back(profile_field{static_cast<uint16_t>(iterator - _profile_keys.begin()), value});
+    }
+
+    if( added ){
+      registry.set(profile_keys{_profile_keys}, get_self());
+    }
+
+    std::sort(fields.begin(), fields.end(), []( const auto& a, const auto& b ){
+      return a.key < b.key;
+    });
+    return fields;
+  }
+
+
+  void transorderdebt::upsert_debt(debt_locator_index& locators, debt_index& legacy, const debt_data& data){
+    check( data.debtor != data.creditor, "debtor and creditor cannot be same one" );
+    check_account( data.debtor, "debtor account does not exist");
+    check_account( data.creditor, "creditor account does not exist");
+
+    check( data.quantity.is_valid(), "invalid quantity" );
+    check( data.fee.is_valid(), "invalid quantity" );
+    check( data.quantity.amount > 0, "must transfer positive quantity" );
+    check( data.fee.amount >= 0, "must transfer positive quantity" );
+    check( data.quantity.symbol == data.fee.symbol, "symbol precision mismatch" );
+
+    auto profile = encode_profile(data.profile);
+
+    uint64_t pkey = 0;
+    auto locator = find_keyed(locators, data.debt_id, pkey);
+
+    if( locator == locators.end() ){
+      if( legacy.begin() != legacy.end() ){
+        auto debt_id_index = legacy.get_index<name("bydebtid")>();
+        auto legacy_iterator = debt_id_index.find(data.debt_id);
+        if( legacy_iterator != debt_id_index.end() ){
+          debt_id_index.erase(legacy_iterator);
+        }
+      }
+
+      uint32_t day = bucket_of(current_block_time());
+      pkey = place_record<keyed_debt_index>("debtsbyid"_n, locators, pkey, data.debt_id, day);
+
+      auto& debts = records_in<keyed_debt_index>(day);
       debts.emplace(get_self(), [&]( auto& row){
-        row.pkey = debts.available_primary_key();
-        row.debt_id = debt_id;
-        row.debtor = debtor;
-        row.creditor = creditor;
-        row.quantity = quantity;
-        row.fee = fee;
-        row.profile.clear();
-        row.profile = profile;
+        row.pkey = pkey;
+        row.debt_id = data.debt_id;
+        row.debtor = data.debtor;
+        row.creditor = data.creditor;
+        row.quantity = data.quantity;
+        row.fee = data.fee;
+        row.profile = std::move(profile);
         row.timestamp = current_block_time();
       });
     }
     else{
-      debts.modify(*iterator, get_self(), [&](auto& row){
-        row.debt_id = debt_id;
-        row.debtor = debtor;
-        row.creditor = creditor;
-        row.quantity = quantity;
-        row.fee = fee;
-        row.profile.clear();
-        row.profile = profile;
+      auto& debts = records_in<keyed_debt_index>(locator->bucket);
+      auto iterator = find_keyed(debts, data.debt_id, pkey);
+      check( iterator != debts.end(), "Debt does not exist in its bucket" );
+
+      debts.modify(iterator, get_self(), [&](auto& row){
+        row.debtor = data.debtor;
+        row.creditor = data.creditor;
+        row.quantity = data.quantity;
+        row.fee = data.fee;
+        row.profile = std::move(profile);
         row.timestamp = current_block_time();
       });
     }
   }
 
 
+  // Updates only the given fields of an existing debt, a given profile replaces the whole profile.
+  void transorderdebt::debtpatch(uint128_t debt_id, std::optional<name> debtor, std::optional<name> creditor, std::optional<asset> quantity,
+                                 std::optional<asset> fee, std::optional<std::map<std::string, std::string>> profile){
+    require_auth(get_self());
+    check( debtor || creditor || quantity || fee || profile, "no fields to patch" );
+
+    if( debtor ){
+      check_account( *debtor, "debtor account does not exist");
+    }
+    if( creditor ){
+      check_account( *creditor, "creditor account does not exist");
+    }
+    if( quantity ){
+      check( quantity->is_valid(), "invalid quantity" );
+      check( quantity->amount > 0, "must transfer positive quantity" );
+    }
+    if( fee ){
+      check( fee->is_valid(), "invalid quantity" );
+      check( fee->amount >= 0, "must transfer positive quantity" );
+    }
+
+    auto patch = [&]( auto& row ){
+      if( debtor ){
+        row.debtor = *debtor;
+      }
+      if( creditor ){
+        row.creditor = *creditor;
+      }
+      if( quantity ){
+        row.quantity = *quantity;
+      }
+      if( fee ){
+        row.fee = *fee;
+      }
+      check( row.debtor != row.creditor, "debtor and creditor cannot be same one" );
+      check( row.quantity.symbol == row.fee.symbol, "symbol precision mismatch" );
+      row.timestamp = current_block_time();
+    };
+
+    debt_locator_index locators(get_self(), get_self().value);
+
+    uint64_t pkey = 0;
+    auto locator = find_keyed(locators, debt_id, pkey);
+    if( locator != locators.end() ){
+      auto& debts = records_in<keyed_debt_index>(locator->bucket);
+      auto iterator = find_keyed(debts, debt_id, pkey);
+      check( iterator != debts.end(), "Debt does not exist in its bucket" );
+
+      debts.modify(iterator, get_self(), [&](auto& row){
+        patch(row);
+        if( profile ){
+          row.profile = encode_profile(*profile);
+        }
+      });
+      return;
+    }
+
+    debt_index legacy(get_self(), get_self().value);
+
+    auto debt_id_index = legacy.get_index<name("bydebtid")>();
+
+    auto iterator = debt_id_index.find(debt_id);
+
+    check(iterator != debt_id_index.end(), "Debt does not exist");
+
+    debt_id_index.modify(iterator, get_self(), [&](auto& row){
+      patch(row);
+      if( profile ){
+        row.profile = *profile;
+      }
+    });
+  }
+
+
   void transorderdebt::debterase(uint128_t debt_id){
     require_auth(get_self());
 
-    debt_index debts(get_self(), get_self().value);
+    debt_locator_index locators(get_self(), get_self().value);
+    if( erase_record<keyed_debt_index>(locators, debt_id) ){
+      return;
+    }
+
+    debt_index legacy(get_self(), get_self().value);
 
-    auto debt_id_index = debts.get_index<name("bydebtid")>();
+    auto debt_id_index = legacy.get_index<name("bydebtid")>();
 
     auto iterator = debt_id_index.find(debt_id);
 
@@ -172,4 +611,103 @@ namespace eosio{
 
     debt_id_index.erase(iterator);
   }
-};
\ No newline at end of file
+
+
+  // Moves at most `max_rows` rows of a legacy table ("transrecords", "orders" or "debts") to its direct-keyed table,
+  // in the bucket of the day they were written.
+  void transorderdebt::migraterecs(name table, uint32_t max_rows){
+    require_auth(get_self());
+    check( max_rows > 0, "max_rows must be positive" );
+
+    uint64_t pkey = 0;
+    if( table == "transrecords"_n ){
+      transrecord_index legacy(get_self(), get_self().value);
+      trans_locator_index locators(get_self(), get_self().value);
+      for( auto iterator = legacy.begin(); iterator != legacy.end() && max_rows > 0; --max_rows ){
+        check( find_keyed(locators, iterator->trans_id, pkey) == locators.end(), "Transrecord already migrated" );
+        uint32_t day = bucket_of(iterator->timestamp);
+        pkey = place_record<keyed_transrecord_index>("transbyid"_n, locators, pkey, iterator->trans_id, day);
+
+        auto& transrecords = records_in<keyed_transrecord_index>(day);
+        transrecords.emplace(get_self(), [&]( auto& row ){
+          row.pkey = pkey;
+          row.trans_id = iterator->trans_id;
+          row.from = iterator->from;
+          row.to = iterator->to;
+          row.quantity = iterator->quantity;
+          row.memo = iterator->memo;
+          row.fee = iterator->fee;
+          row.timestamp = iterator->timestamp;
+        });
+        iterator = legacy.erase(iterator);
+      }
+    }
+    else if( table == "orders"_n ){
+      order_index legacy(get_self(), get_self().value);
+      order_locator_index locators(get_self(), get_self().value);
+      for( auto iterator = legacy.begin(); iterator != legacy.end() && max_rows > 0; --max_rows ){
+        check( find_keyed(locators, iterator->order_id, pkey) == locators.end(), "Order already migrated" );
+        uint32_t day = bucket_of(iterator->timestamp);
+        pkey = place_record<keyed_order_index>("ordersbyid"_n, locators, pkey, iterator->order_id, day);
+
+        auto& orders = records_in<keyed_order_index>(day);
+        orders.emplace(get_self(), [&]( auto& row ){
+          row.pkey = pkey;
+          row.order_id = iterator->order_id;
+          row.account = iterator->account;
+          row.logistics = iterator->logistics;
+          row.goods_info = iterator->goods_info;
+          row.merchant = iterator->merchant;
+          row.timestamp = iterator->timestamp;
+        });
+        iterator = legacy.erase(iterator);
+      }
+    }
+    else if( table == "debts"_n ){
+      debt_index legacy(get_self(), get_self().value);
+      debt_locator_index locators(get_self(), get_self().value);
+      for( auto iterator = legacy.begin(); iterator != legacy.end() && max_rows > 0; --max_rows ){
+        check( find_keyed(locators, iterator->debt_id, pkey) == locators.end(), "Debt already migrated" );
+        uint32_t day = bucket_of(iterator->timestamp);
+        pkey = place_record<keyed_debt_index>("debtsbyid"_n, locators, pkey, iterator->debt_id, day);
+
+        auto& debts = records_in<keyed_debt_index>(day);
+        debts.emplace(get_self(), [&]( auto& row ){
+          row.pkey = pkey;
+          row.debt_id = iterator->debt_id;
+          row.debtor = iterator->debtor;
+          row.creditor = iterator->creditor;
+          row.quantity = iterator->quantity;
+          row.fee = iterator->fee;
+          row.profile = encode_profile(iterator->profile);
+          row.timestamp = iterator->timestamp;
+        });
+        iterator = legacy.erase(iterator);
+      }
+    }
+    else{
+      check( false, "table must be one of [transrecords, orders, debts]" );
+    }
+  }
+
+
+  // Drops the records of the direct-keyed table `table` ("transbyid", "ordersbyid" or "debtsbyid") created
+  // before the day bucket `before_bucket`, at most `max_rows` per call.
+  void transorderdebt::prune(name table, uint32_t before_bucket, uint32_t max_rows){
+    require_auth(get_self());
+    check( max_rows > 0, "max_rows must be positive" );
+
+    if( table == "transbyid"_n ){
+      prune_records<keyed_transrecord_index, trans_locator_index>(table, before_bucket, max_rows);
+    }
+    else if( table == "ordersbyid"_n ){
+      prune_records<keyed_order_index, order_locator_index>(table, before_bucket, max_rows);
+    }
+    else if( table == "debtsbyid"_n ){
+      prune_records<keyed_debt_index, debt_locator_index>(table, before_bucket, max_rows);
+    }
+    else{
+      check( false, "table must be one of [transbyid, ordersbyid, debtsbyid]" );
+    }
+  }
+};